@@ -0,0 +1,133 @@
+// bench.cpp - runs a fixed set of workloads and reports time per run, VM instructions per second
+// and dictionary usage. See the bench targets in GNUmakefile for the builds it can be compared across
+
+#define WF_COUNT_INSTRUCTIONS 1
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "woof.h"
+
+using namespace woof;
+
+StaticStateConfig<1024, 8, 256, 128, 8*1024*1024> memory;
+
+static std::string read_file(const char* path) {
+  std::ifstream t(path);
+  return std::string((std::istreambuf_iterator<char>(t)), (std::istreambuf_iterator<char>()));
+}
+
+struct Workload {
+  const char* name;
+  /** Run once before timing, e.g. to define words */
+  std::string setup;
+  /** Source timed for each run */
+  std::string run;
+  size_t runs;
+};
+
+/** Sends stdout to /dev/null while in scope, so printing workloads measure the VM and not the terminal */
+struct DiscardOutput {
+  DiscardOutput() {
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+  }
+
+  ~DiscardOutput() {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+  }
+
+  int saved;
+};
+
+static Error run_workload(State& state, const Workload& w) {
+  size_t memory_start = state.memory_i;
+  Error e;
+  std::chrono::steady_clock::time_point start, end;
+
+  {
+    DiscardOutput discard;
+    WF_CHECK(state.exec(w.setup.c_str()));
+
+    state.instruction_count = 0;
+    start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i != w.runs; i++) {
+      e = state.exec(w.run.c_str());
+      if(e != E_OK) {
+        return e;
+      }
+    }
+    end = std::chrono::steady_clock::now();
+  }
+
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  printf("%-24s %8zu runs %14.0f ns/op %10.1f M instructions/sec %10zu dictionary bytes\n", w.name, w.runs,
+    ns / w.runs, state.instruction_count / (ns / 1e9) / 1e6, state.memory_i - memory_start);
+  return E_OK;
+}
+
+int main() {
+  State state(memory);
+
+  Error e = state.exec(read_file("prelude.fs").c_str());
+  if(e != E_OK) {
+    std::cout << "Error loading prelude: " << error_description(e) << std::endl;
+    return 1;
+  }
+
+  state.defw("bench-add", [](State& s) {
+    Cell a, b;
+    WF_CHECK(s.pop(a));
+    WF_CHECK(s.pop(b));
+    return s.push(a.bits + b.bits);
+  }, DictEntry::effect(2, 1));
+
+  std::string definitions;
+  for(size_t i = 0; i != 100; i++) {
+    definitions += ": def" + std::to_string(i) + " " + std::to_string(i) + " dup + drop ; ";
+  }
+
+  Workload workloads[] = {
+    {"examples/fib.fs", "", read_file("examples/fib.fs"), 1},
+    {"examples/fizzbuzz.fs", read_file("examples/fizzbuzz.fs"), "101 fizzbuzz", 1000},
+    {"locals",
+      ": locals-heavy { a b c } a b + c * a - b c + drop ; "
+      ": locals-loop 0 begin 1 2 3 locals-heavy drop 1 + dup 10000 = until drop ;",
+      "locals-loop", 100},
+    {"c++ interop",
+      ": interop-loop 0 begin 1 bench-add dup 100000 = until drop ;",
+      "interop-loop", 100},
+    // Last, since it leaves thousands of words behind
+    {"dictionary", "", definitions + "def0 def99", 100},
+  };
+
+  printf("dispatch: %s%s%s\n", WF_COMPUTED_GOTO ? "computed goto" : "switch", WF_UNSAFE ? ", unsafe" : "",
+    WF_JIT ? ", jit" : "");
+
+  for(const Workload& w : workloads) {
+    e = run_workload(state, w);
+    if(e != E_OK) {
+      std::cout << w.name << ": " << state.scratch << std::endl << error_description(e) << std::endl;
+      return 1;
+    }
+  }
+
+  printf("peak dictionary usage: %zu of %zu bytes\n", state.memory_i, state.memory_size);
+#if WF_JIT
+  printf("jit: %zu words compiled, %zu of %zu bytes of machine code\n", state.jit_words_i, state.jit_i,
+    (size_t) WF_JIT_SIZE);
+#endif
+
+  return 0;
+}
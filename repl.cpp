@@ -12,11 +12,13 @@
 
 using namespace woof;
 
-StaticStateConfig<> memory;
+// Memory is committed as it is used, up to 1GB
+GrowableStateConfig<> memory;
 
 int main(int argc, char** argv) {
   bool do_repl = true;
   std::vector<std::string> do_files;
+  std::string load_image, save_image;
 
   if(argc > 1) {
     do_repl = false;
@@ -24,6 +26,10 @@ int main(int argc, char** argv) {
       std::string s(argv[i]);
       if(s.compare("--repl") == 0) {
         do_repl = true;
+      } else if(s.compare("--image") == 0 && i + 1 != argc) {
+        load_image = argv[++i];
+      } else if(s.compare("--save-image") == 0 && i + 1 != argc) {
+        save_image = argv[++i];
       } else {
         do_files.push_back(s);
       }
@@ -50,13 +56,20 @@ int main(int argc, char** argv) {
     return E_OK;
   });
   */
+
+  // Boot from an image saved with --save-image rather than interpreting the same files again
+  if(!load_image.empty()) {
+    FILE* f = fopen(load_image.c_str(), "rb");
+    Error e = f ? state.load_image(f) : E_IO;
+    if(f) fclose(f);
+    if(e != E_OK) {
+      std::cout << "Error loading image " << load_image << ": " << error_description(e) << std::endl;
+      return 1;
+    }
+  }
  
   for(size_t i = 0; i != do_files.size(); i += 1) {
-    std::ifstream t(do_files[i]);
-
-    std::string body((std::istreambuf_iterator<char>(t)), (std::istreambuf_iterator<char>()));
-
-    Error e = state.exec(body.c_str());
+    Error e = state.include(do_files[i].c_str());
 
     if(e != E_OK) {
       std::cout << "Error: " << state.scratch << std::endl << error_description(e) << std::endl;;
@@ -64,6 +77,16 @@ int main(int argc, char** argv) {
 
   }
 
+  if(!save_image.empty()) {
+    FILE* f = fopen(save_image.c_str(), "wb");
+    Error e = f ? state.save_image(f) : E_IO;
+    if(f) fclose(f);
+    if(e != E_OK) {
+      std::cout << "Error saving image " << save_image << ": " << error_description(e) << std::endl;
+      return 1;
+    }
+  }
+
   if(do_repl) {
     std::cout << "woof \\o/" << std::endl;
 
@@ -2,13 +2,21 @@
 #include "doctest.h"
 
 #include "woof.h"
+#include "woof-channel.h"
+#include "woof-pool.h"
+
+#include <string>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace woof;
 
 struct TestState {
   TestState(): cfg(), state(cfg) {}
 
-  StaticStateConfig<8, 8, 8, 100, 1024*2> cfg;
+  StaticStateConfig<8, 8, 8, 100, 1024*4> cfg;
   State state;
 };
 
@@ -95,6 +103,793 @@ TEST_CASE("woof") {
     // TODO: Test that these are actually strings
   }
 
+  SUBCASE("compiles builtins to native opcodes") {
+    // Left unoptimized, which would work it all out while compiling
+    CHECK(s.exec("optimize-off : arith 7 3 - 2 * 5 % 1 swap dup drop > 4 4 = ; optimize-on arith") == E_OK);
+    CHECK(s.si == 2);
+    CHECK(s.stack[0].bits == 0);
+    CHECK(s.stack[1].bits == 1);
+
+    DictEntry* d = s.lookup("arith");
+    REQUIRE(d);
+    CHECK(d->data<ptrdiff_t>()[4] == OP_SUB);
+
+#if !WF_UNSAFE
+    s.si = 0;
+    CHECK(s.exec(": underflow + ; underflow") == E_STACK_UNDERFLOW);
+    CHECK(s.exec(": modzero 1 0 % ; modzero") == E_DIVIDE_BY_ZERO);
+#endif
+  }
+
+  SUBCASE("optimizes words as ; finishes them") {
+    auto code = [&](const char* name, size_t i) {
+      ptrdiff_t* code = s.lookup(name)->data<ptrdiff_t>();
+#if WF_JIT
+      // Words compiled to machine code start with OP_NATIVE
+      const ptrdiff_t* saved = s.jit_saved(code);
+      if(saved && i < 2) {
+        return saved[i];
+      }
+#endif
+      return code[i];
+    };
+    CHECK(s.exec(": if 4 , here -1 , ; immediate : else 5 , here -1 , swap here swap ! ; immediate") == E_OK);
+    CHECK(s.exec(": then here swap ! ; immediate") == E_OK);
+
+    // Constants are worked out, including conditions, and code that can't be reached goes
+    CHECK(s.exec(": arith 7 3 - 2 * 5 % 1 swap dup drop > 4 4 = ; : pick 0 if 1 else 2 then ;") == E_OK);
+    CHECK(code("arith", 0) == OP_PUSH_IMMEDIATE);
+    CHECK(code("arith", 1) == 3);
+    CHECK(code("arith", 4) == OP_SWAP);
+    CHECK(code("pick", 0) == OP_PUSH_IMMEDIATE);
+    CHECK(code("pick", 1) == 2);
+    CHECK(code("pick", 2) == OP_EXIT);
+    CHECK(s.exec("arith pick") == E_OK);
+    CHECK(s.si == 3);
+    CHECK(s.stack[0].bits == 0);
+    CHECK(s.stack[1].bits == 1);
+    CHECK(s.stack[2].bits == 2);
+
+    // Jumps over locals go straight past all of them, and reading a local just set is a dup
+    s.si = 0;
+    CHECK(s.exec("optimize-off : plain { a b } a b - ; optimize-on : fast { a b } a b - ; 5 3 plain 5 3 fast") == E_OK);
+    CHECK(s.si == 2);
+    CHECK(s.stack[0].bits == 2);
+    CHECK(s.stack[1].bits == 2);
+    CHECK(code("fast", 0) == OP_JUMP_IGNORED);
+    ptrdiff_t* body = s.raddr_to_real((ptrdiff_t*) code("fast", 1));
+    CHECK(body[0] == OP_LOCAL_SET);
+    CHECK(body[1] == OP_DUP);
+    CHECK(body[2] == OP_LOCAL_SET);
+    CHECK(body[3] == OP_LOCAL_PUSH);
+
+    // Division by zero is left for the VM to report
+    CHECK(s.exec(": modzero 1 0 % ;") == E_OK);
+    CHECK(code("modzero", 4) == OP_MOD);
+  }
+
+  SUBCASE("bounds recursion depth with the return stack") {
+    CHECK(s.exec(": forever forever 1 ; forever") == E_STACK_OVERFLOW);
+    CHECK(s.ri == 0);
+    CHECK(s.exec(": inner 2 ; : outer 1 inner 3 ; outer") == E_OK);
+    CHECK(s.si == 3);
+    CHECK(s.stack[2].bits == 3);
+  }
+
+  SUBCASE("eliminates tail calls") {
+    CHECK(s.exec(": if 4 , here -1 , ; immediate : then here swap ! ; immediate") == E_OK);
+    CHECK(s.exec(": down { n } n if n 1 - down then ; 5000 down") == E_OK);
+    CHECK(s.si == 0);
+    CHECK(s.locals.i == 0);
+
+    DictEntry* d = s.lookup("down");
+    REQUIRE(d);
+    ptrdiff_t* code = d->data<ptrdiff_t>();
+    bool found = false;
+    for(size_t i = 0; &code[i+1] < (ptrdiff_t*) &s.memory[s.memory_i]; i++) {
+      if(code[i] == OP_TAIL_CALL && code[i+1] == s.real_to_raddr(code)) {
+        found = true;
+      }
+    }
+    CHECK(found);
+  }
+
+  SUBCASE("looks up the latest visible definition") {
+    CHECK(s.exec(": x 1 ; : y 2 ; : x 3 ;") == E_OK);
+    CHECK(s.lookup("x") == s.shared[S_LATEST].as<DictEntry>());
+    CHECK(!s.lookup("nothing"));
+
+    s.lookup("x")->flags |= DictEntry::FLAG_HIDDEN;
+    CHECK(s.exec("x y") == E_OK);
+    CHECK(s.si == 2);
+    CHECK(s.stack[0].bits == 1);
+    CHECK(s.stack[1].bits == 2);
+  }
+
+  SUBCASE("can compile once and run many times") {
+    ptrdiff_t* code = 0;
+    CHECK(s.exec(": five 5 ; immediate") == E_OK);
+    CHECK(s.compile("2 3 + five \"str\"", code) == E_OK);
+    CHECK(s.si == 0);
+
+    CHECK(s.exec(code) == E_OK);
+    CHECK(s.exec(code) == E_OK);
+    CHECK(s.si == 6);
+    CHECK(s.stack[0].bits == 5);
+    CHECK(s.stack[1].bits == 5);
+    CHECK(s.stack[2].bits == s.stack[5].bits);
+
+    size_t here = s.memory_i;
+    CHECK(s.compile("1 missing", code) == E_WORD_NOT_FOUND);
+    CHECK(s.memory_i == here);
+  }
+
+  SUBCASE("compile rejects words that read input") {
+    ptrdiff_t* code = 0;
+    size_t here = s.memory_i;
+    CHECK(s.compile(": sq dup * ;", code) == E_WANT_WORD);
+    CHECK(s.compile("variable x", code) == E_WANT_WORD);
+    CHECK(s.compile("1 ' dup", code) == E_WANT_WORD);
+    CHECK(s.memory_i == here);
+    CHECK(!s.lookup("sq"));
+  }
+
+#if WF_JIT && !WF_PREEMPT
+  SUBCASE("compiles words to machine code") {
+    // With a data stack deep enough for fib
+    StaticStateConfig<32, 8, 8, 100, 1024*4> jcfg;
+    State j(jcfg);
+    CHECK(j.exec(": if 4 , here -1 , ; immediate : then here swap ! ; immediate") == E_OK);
+    CHECK(j.exec(": fib dup 1 > if dup 1 - fib swap 2 - fib + then ; 20 fib") == E_OK);
+    CHECK(j.si == 1);
+    CHECK(j.stack[0].bits == 6765);
+
+    DictEntry* d = j.lookup("fib");
+    REQUIRE(d);
+    CHECK(d->data<ptrdiff_t>()[0] == OP_NATIVE);
+
+#if !WF_UNSAFE
+    j.si = 0;
+    CHECK(j.exec("fib") == E_STACK_UNDERFLOW);
+#endif
+    CHECK(j.exec(": forever forever 1 ; forever") == E_STACK_OVERFLOW);
+    CHECK(j.ri == 0);
+
+    // Machine code that defines a word, making its own page writable, can carry on once it returns
+    j.si = 0;
+    j.defw("define-late", [](State& s) { return s.exec(": late 7 ;"); });
+    CHECK(j.exec(": early 1 define-late 2 + ; early late") == E_OK);
+    CHECK(j.lookup("early")->data<ptrdiff_t>()[0] == OP_NATIVE);
+    CHECK(j.lookup("late")->data<ptrdiff_t>()[0] == OP_NATIVE);
+    CHECK(j.si == 2);
+    CHECK(j.stack[0].bits == 3);
+    CHECK(j.stack[1].bits == 7);
+
+#if !WF_UNSAFE
+    // Words without a known stack effect check each push
+    j.si = 0;
+    CHECK(j.exec(": r dup if 1 - r 0 + then ; : x 0 r ; 5 r x") == E_OK);
+    CHECK(j.lookup("r")->data<ptrdiff_t>()[0] == OP_NATIVE);
+    CHECK(j.si == 2);
+    j.si = j.stack_size - 1;
+    CHECK(j.exec("x") == E_STACK_OVERFLOW);
+    CHECK(j.si == j.stack_size);
+
+    // Locals are checked like the interpreter does
+    DictEntry* bad;
+    CHECK(j.create("bad-local", bad) == E_OK);
+    size_t start = j.memory_i;
+    CHECK(j.dict_put(OP_LOCAL_PUSH) == E_OK);
+    CHECK(j.dict_put(0) == E_OK);
+    CHECK(j.dict_put(OP_EXIT) == E_OK);
+    REQUIRE(j.jit_word(start, j.memory_i));
+    j.si = 0;
+    CHECK(j.exec("bad-local") == E_OUT_OF_RANGE);
+    CHECK(j.locals.i == 0);
+#endif
+  }
+
+  SUBCASE("keeps compiling once the table of compiled words fills") {
+    GrowableStateConfig<> gcfg;
+    State g(gcfg);
+    std::string defs;
+    for(size_t i = 0; i != WF_JIT_WORDS + 16; i++) {
+      defs += ": w" + std::to_string(i) + " " + std::to_string(i) + " 1 + ; ";
+    }
+    CHECK(g.exec((defs + "w0 w4100").c_str()) == E_OK);
+    CHECK(g.jit_words_i > WF_JIT_WORDS);
+    CHECK(g.lookup("w4100")->data<ptrdiff_t>()[0] == OP_NATIVE);
+    CHECK(g.si == 2);
+    CHECK(g.stack[1].bits == 4101);
+  }
+
+#endif
+#if WF_PROFILE && !WF_JIT
+  SUBCASE("profiles words and opcodes") {
+    CHECK(s.exec(": if 4 , here -1 , ; immediate : then here swap ! ; immediate") == E_OK);
+    CHECK(s.exec(": inner 1 + ; : fact dup 1 > if dup 1 - fact * then ; : outer 0 inner inner drop 3 fact drop ;") == E_OK);
+    CHECK(s.exec("profile-on outer outer profile-off outer") == E_OK);
+
+    const ProfileWord* outer = s.profile_lookup("outer");
+    const ProfileWord* inner = s.profile_lookup("inner");
+    const ProfileWord* fact = s.profile_lookup("fact");
+    REQUIRE(outer);
+    REQUIRE(inner);
+    REQUIRE(fact);
+    CHECK(outer->calls == 2);
+    CHECK(inner->calls == 4);
+    CHECK(fact->calls == 6);
+    CHECK(fact->active == 0);
+    CHECK(outer->inclusive >= fact->inclusive + inner->inclusive);
+    CHECK(outer->exclusive <= outer->inclusive);
+    CHECK(s.profile.opcodes[OP_MUL] == 4);
+    CHECK(s.profile.opcodes[OP_EXIT] == 12);
+
+    s.si = 0;
+    s.profile_reset();
+    s.profiling = true;
+    CHECK(s.exec(": underflow fact + ; 1 underflow") == E_STACK_UNDERFLOW);
+    CHECK(s.profile_lookup("fact")->active == 0);
+    CHECK(s.profile_lookup("underflow")->active == 0);
+  }
+
+#endif
+  SUBCASE("reads source a chunk at a time") {
+    // One byte at a time, so that every token spans a refill
+    struct Source {
+      const char* text;
+      static ptrdiff_t read(void* ctx, char* buffer, size_t) {
+        Source* src = (Source*) ctx;
+        if(*src->text == 0) {
+          return 0;
+        }
+        *buffer = *src->text++;
+        return 1;
+      }
+    } src = {": twelve 12 ; twelve -345 \"a string\" \\ comment\n6"};
+
+    CHECK(s.exec(&Source::read, &src) == E_OK);
+    CHECK(s.si == 4);
+    CHECK(s.stack[0].bits == 12);
+    CHECK(s.stack[1].bits == -345);
+    CHECK(s.stack[3].bits == 6);
+    String* str = (String*) s.raddr_to_real((ptrdiff_t*) s.stack[2].bits);
+    CHECK(strcmp(str->bytes, "a string") == 0);
+  }
+
+  SUBCASE("can include files") {
+    FILE* f = fopen("test-include.fs", "w");
+    REQUIRE(f);
+    fputs(": included 5 ; included", f);
+    fclose(f);
+
+    CHECK(s.exec("1 include test-include.fs included") == E_OK);
+    remove("test-include.fs");
+    CHECK(s.si == 3);
+    CHECK(s.stack[1].bits == 5);
+    CHECK(s.stack[2].bits == 5);
+    CHECK(s.exec("include missing.fs") == E_IO);
+  }
+
+  SUBCASE("can save and load images") {
+    s.defw("host-seven", [](State& s) { return s.push(7); });
+    CHECK(s.exec(": if 4 , here -1 , ; immediate : then here swap ! ; immediate") == E_OK);
+    CHECK(s.exec("variable v 3 v ! : sevens host-seven v @ if host-seven then ; : greeting \"hi\" ;") == E_OK);
+
+    FILE* f = tmpfile();
+    REQUIRE(f);
+    CHECK(s.save_image(f) == E_OK);
+
+    // Defined in a different order, so the cword gets a different index
+    TestState loaded_state;
+    State& l = loaded_state.state;
+    l.defw("unrelated", [](State&) { return E_OK; });
+    l.defw("host-seven", [](State& s) { return s.push(7); });
+
+    rewind(f);
+    CHECK(l.load_image(f) == E_OK);
+    fclose(f);
+
+    CHECK(l.memory_i == s.memory_i);
+    CHECK(l.exec("sevens v @ : more sevens sevens ; more") == E_OK);
+    CHECK(l.si == 7);
+    CHECK(l.stack[0].bits == 7);
+    CHECK(l.stack[2].bits == 3);
+    CHECK(l.stack[6].bits == 7);
+    CHECK(!l.lookup("unrelated"));
+
+    CHECK(l.exec("greeting") == E_OK);
+    String* str = (String*) l.raddr_to_real((ptrdiff_t*) l.stack[l.si-1].bits);
+    CHECK(strcmp(str->bytes, "hi") == 0);
+
+    // Bucket chains are relinked on load, as if the image was saved with another index size
+    for(DictEntry* d = l.shared[S_LATEST].as<DictEntry>(); d; d = l.dict_follow(d->previous)) {
+      d->bucket_previous = -1;
+    }
+    l.index_rebuild();
+    CHECK(l.lookup("sevens"));
+    CHECK(l.lookup("v"));
+    CHECK(l.lookup("greeting"));
+    CHECK(l.lookup("host-seven"));
+    CHECK(l.lookup("dup"));
+
+    // Loading fails if a C++ word isn't defined
+    f = tmpfile();
+    REQUIRE(f);
+    CHECK(s.save_image(f) == E_OK);
+    rewind(f);
+    TestState missing_state;
+    CHECK(missing_state.state.load_image(f) == E_WORD_NOT_FOUND);
+    fclose(f);
+  }
+
+  SUBCASE("can clone a state") {
+    s.defw("host-seven", [](State& s) { return s.push(7); });
+    CHECK(s.exec("variable v 3 v ! : get host-seven v @ ; 42") == E_OK);
+
+    // As if left over from an earlier State
+    StaticStateConfig<8, 8, 8, 100, 1024*4> cfg;
+    memset(cfg.memory, 0xff, cfg.memory_size);
+    CHECK(s.clone_into(cfg) == E_OK);
+    State c(cfg);
+
+    CHECK(c.si == 1);
+    CHECK(c.stack[0].bits == 42);
+    CHECK(c.exec("get 5 v ! : new 1 ; new get") == E_OK);
+    CHECK(c.si == 6);
+    CHECK(c.stack[1].bits == 7);
+    CHECK(c.stack[2].bits == 3);
+    CHECK(c.stack[5].bits == 5);
+
+    // Changes to the clone aren't seen by the original
+    CHECK(!s.lookup("new"));
+    CHECK(s.exec("get") == E_OK);
+    CHECK(s.stack[s.si-1].bits == 3);
+
+    StaticStateConfig<8, 8, 8, 100, 64> small;
+    CHECK(s.clone_into(small) == E_OUT_OF_MEMORY);
+  }
+
+  SUBCASE("can share a base dictionary") {
+    s.defw("host-seven", [](State& s) { return s.push(7); });
+    CHECK(s.exec("variable v 3 v ! : get host-seven v @ ;") == E_OK);
+    size_t base_i = s.memory_i;
+
+    StaticStateConfig<8, 8, 8, 100, 512> cfg_a, cfg_b;
+    cfg_a.base = cfg_b.base = &s;
+    State a(cfg_a), b(cfg_b);
+
+    CHECK(a.exec(": get2 get v @ + ; get2 variable w 5 w ! w @") == E_OK);
+    CHECK(a.si == 3);
+    CHECK(a.stack[1].bits == 6);
+    CHECK(a.stack[2].bits == 5);
+    CHECK(a.memory_i > base_i);
+
+    // Clones of a layer share its base
+    StaticStateConfig<8, 8, 8, 100, 512> cfg_c;
+    CHECK(a.clone_into(cfg_c) == E_OK);
+    State c(cfg_c);
+    CHECK(c.exec("drop drop drop get2 w @") == E_OK);
+    CHECK(c.si == 3);
+    CHECK(c.stack[1].bits == 6);
+    CHECK(c.stack[2].bits == 5);
+
+    // The base is read only
+    CHECK(a.exec("5 v !") == E_INVALID_ADDRESS);
+#if !WF_UNSAFE
+    CHECK(a.exec(": set-v v ! ; 5 set-v") == E_INVALID_ADDRESS);
+#endif
+    CHECK(b.exec("immediate") == E_INVALID_ADDRESS);
+
+    // Each layer only sees its own words
+    CHECK(!b.lookup("get2"));
+    CHECK(b.exec(": get 1 ; get") == E_OK);
+    CHECK(b.stack[b.si-1].bits == 1);
+    CHECK(a.exec("get") == E_OK);
+    CHECK(a.stack[a.si-1].bits == 3);
+    CHECK(s.memory_i == base_i);
+    CHECK(!s.lookup("get2"));
+  }
+
+  SUBCASE("can forget words") {
+    CHECK(s.exec(": keep 1 ; : also 2 ;") == E_OK);
+    size_t here = s.memory_i, cwords_i = s.cwords.i;
+
+    CHECK(s.exec("marker scratch : keep 3 ; : gone 4 ; keep") == E_OK);
+    CHECK(s.stack[s.si-1].bits == 3);
+    CHECK(s.exec("scratch keep") == E_OK);
+    CHECK(s.stack[s.si-1].bits == 1);
+    CHECK(s.memory_i == here);
+    CHECK(s.exec("gone") == E_WORD_NOT_FOUND);
+    CHECK(s.exec("scratch") == E_WORD_NOT_FOUND);
+
+    CHECK(s.exec(": gone 5 ; forget also gone") == E_WORD_NOT_FOUND);
+    CHECK(s.exec("keep") == E_OK);
+
+    // A host can reset to a checkpoint, dropping C++ words and machine code
+    State::Checkpoint cp = s.checkpoint();
+    s.defw("seven", [](State& s) { return s.push(7); });
+    CHECK(s.exec(": twice-seven seven seven + ; twice-seven") == E_OK);
+    CHECK(s.stack[s.si-1].bits == 14);
+    CHECK(s.restore(cp) == E_OK);
+    CHECK(s.cwords.i == cwords_i);
+    CHECK(!s.lookup("seven"));
+    CHECK(s.exec(": gone 6 ; gone") == E_OK);
+    CHECK(s.stack[s.si-1].bits == 6);
+  }
+
+#if WF_VERIFY
+  SUBCASE("verifies words before running them unchecked") {
+    CHECK(s.exec(": sq dup * 1 + ; : sum-sq { x y } x sq y sq + ;") == E_OK);
+    ptrdiff_t sq = s.real_to_raddr(s.lookup("sq")->data<ptrdiff_t>());
+    CHECK(s.verify_entry(sq));
+    CHECK(s.verify_entry(s.real_to_raddr(s.lookup("sum-sq")->data<ptrdiff_t>())));
+    CHECK(s.exec("3 4 sum-sq") == E_OK);
+    CHECK(s.stack[s.si-1].bits == 27);
+
+    ptrdiff_t* block;
+    CHECK(s.compile("2 sq", block) == E_OK);
+    CHECK(s.verify_entry((ptrdiff_t) block));
+
+    // Overwriting an instruction demotes everything until the next definition
+    CHECK(s.exec("11 ' sq 32 + !") == E_OK);
+    CHECK(!s.verify_entry(sq));
+    CHECK(s.exec("3 sq") == E_OK);
+#if !WF_JIT
+    CHECK(s.stack[s.si-1].bits == 8);
+#endif
+    CHECK(s.exec(": poke ! ;") == E_OK);
+    CHECK(s.verify_entry(sq));
+    CHECK(s.exec("' sq @ ' sq poke") == E_OK);
+    CHECK(!s.verify_entry(sq));
+    CHECK(s.exec(": later 1 ;") == E_OK);
+    CHECK(s.verify_entry(sq));
+
+    // Reading a local that was never set is caught when checked, and fails verification
+    DictEntry* d;
+    CHECK(s.create("bad-local", d) == E_OK);
+    size_t start = s.memory_i;
+    CHECK(s.dict_put(OP_LOCAL_PUSH) == E_OK);
+    CHECK(s.dict_put(0) == E_OK);
+    CHECK(s.dict_put(OP_EXIT) == E_OK);
+    CHECK(!s.verify_word(start, s.memory_i));
+    CHECK(s.exec("bad-local") == E_OUT_OF_RANGE);
+
+    // Jumps must land on instructions, not operands
+    CHECK(s.create("bad-jump", d) == E_OK);
+    start = s.memory_i;
+    CHECK(s.dict_put(OP_JUMP) == E_OK);
+    CHECK(s.dict_put(start + sizeof(Cell)) == E_OK);
+    CHECK(s.dict_put(OP_EXIT) == E_OK);
+    CHECK(!s.verify_word(start, s.memory_i));
+
+    // A word still verifies when it fills the dictionary
+    size_t before = s.memory_i;
+    CHECK(s.exec(": tight dup * ;") == E_OK);
+    size_t size = s.memory_i - before;
+    CHECK(s.exec("forget tight") == E_OK);
+    char* pad;
+    REQUIRE(s.allot(s.memory_size - s.memory_i - size - sizeof(Cell), pad) == E_OK);
+    CHECK(s.exec(": tight dup * ;") == E_OK);
+    CHECK(s.memory_size - s.memory_i == sizeof(Cell));
+    CHECK(s.verify_entry(s.real_to_raddr(s.lookup("tight")->data<ptrdiff_t>())));
+  }
+
+  SUBCASE("works out stack effects to check the stack once per word") {
+    StackEffect e = {};
+    auto effect = [&](const char* name, StackEffect& e) {
+      return s.verify_effect(s.real_to_raddr(s.lookup(name)->data<ptrdiff_t>()), e);
+    };
+    CHECK(s.exec(": if 4 , here -1 , ; immediate : then here swap ! ; immediate") == E_OK);
+    CHECK(s.exec(": sq dup * ; : sum-sq { x y } x sq y sq + ; : down dup if 1 - down then ;") == E_OK);
+    REQUIRE(effect("sq", e));
+    CHECK((e.in == 1 && e.out == 1 && e.peak == 2));
+    REQUIRE(effect("sum-sq", e));
+    CHECK((e.in == 2 && e.out == 1 && e.peak == 3));
+    REQUIRE(effect("down", e));
+    CHECK((e.in == 1 && e.out == 1 && e.peak == 2));
+    CHECK(s.exec("3 4 sum-sq 5 down") == E_OK);
+    CHECK(s.si == 2);
+    CHECK(s.stack[0].bits == 25);
+    CHECK(s.stack[1].bits == 0);
+
+    // Unbalanced paths and C words without a declared effect leave it unknown
+    CHECK(s.exec(": maybe dup if 1 then ; : show \"x\" fmt ;") == E_OK);
+    CHECK(!effect("maybe", e));
+    CHECK(!effect("show", e));
+
+    // Words entered without enough stack run checked, and fail as they would have
+    s.si = 0;
+    CHECK(s.exec("sq") == E_STACK_UNDERFLOW);
+    CHECK(s.exec("1 2 3 4 5 6 7 sq") == E_OK);
+    CHECK(s.exec("8 sq") == E_STACK_OVERFLOW);
+    CHECK(s.push(9) == E_STACK_OVERFLOW);
+
+    // A C word that doesn't keep to its declared effect makes the VM check the stack again
+    s.si = 0;
+    s.defw("liar", [](State&) { return E_OK; }, DictEntry::effect(0, 1));
+    CHECK(s.exec(": use-liar liar drop ;") == E_OK);
+    REQUIRE(effect("use-liar", e));
+    CHECK(s.exec("use-liar") == E_STACK_UNDERFLOW);
+  }
+#endif
+
+  SUBCASE("can grow memory") {
+    GrowableStateConfig<8, 8, 8, 100> cfg(64 * 1024, 4096);
+    State g(cfg);
+    size_t initial = g.memory_size;
+
+    CHECK(g.exec("8192 allot 5 swap ! : five 5 ; five") == E_OK);
+    CHECK(g.memory_size > initial);
+    CHECK(g.stack[g.si-1].bits == 5);
+    CHECK(g.exec("1000000 allot") == E_OUT_OF_MEMORY);
+  }
+
+  SUBCASE("turns faults on guard pages into errors") {
+    GuardedStateConfig<8, 8, 8, 100> cfg(64 * 1024, 4096);
+    State g(cfg);
+    REQUIRE(cfg.guard_size != 0);
+    // Stacks are rounded up to whole pages
+    CHECK(g.stack_size == cfg.page_size / sizeof(Cell));
+
+    // Faults in Forth code, that is, rather than in C words the interpreter calls
+    CHECK(g.exec(": add1 1 + ; add1") == E_STACK_UNDERFLOW);
+    g.si = 0;
+    CHECK(g.exec(": zap drop ; 1 zap zap") == E_STACK_UNDERFLOW);
+    CHECK(g.exec(": begin here ; immediate : until 4 , , ; immediate") == E_OK);
+    CHECK(g.exec(": fill begin 1 0 until ; fill") == E_STACK_OVERFLOW);
+    CHECK(g.si == g.stack_size);
+    g.si = 0;
+    CHECK(g.exec(": deep 1 { a } deep a ; deep") == E_OUT_OF_MEMORY);
+    CHECK(g.locals.i == 0);
+    CHECK(g.ri == 0);
+    g.si = 0;
+
+    // The State carries on as usual afterwards
+    CHECK(g.exec("2 3 + : five 5 ; five") == E_OK);
+    CHECK(g.si == 2);
+    CHECK(g.stack[0].bits == 5);
+    CHECK(g.stack[1].bits == 5);
+
+    // Faults in C words aren't caught, since jumping out of them would skip their destructors
+    g.defw("poke-below", [](State& s) { ((volatile Cell*) s.stack)[-1].bits = 0; return E_OK; });
+    pid_t child = fork();
+    if(child == 0) {
+      g.exec(": poke poke-below ; poke");
+      _exit(0);
+    }
+    int status;
+    REQUIRE(waitpid(child, &status, 0) == child);
+    CHECK((WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV));
+  }
+
+  SUBCASE("can allocate from the heap") {
+    StaticStateConfig<8, 8, 8, 100, 1024*4, 1024, 4096> hcfg;
+    State h(hcfg);
+    CHECK(h.exec(": peek @ ; : poke ! ;") == E_OK);
+    size_t here = h.memory_i;
+
+    CHECK(h.exec("100 allocate") == E_OK);
+    CHECK(h.stack[h.si-1].bits == E_OK);
+    CHECK(h.memory_i == here);
+    ptrdiff_t a = h.stack[h.si-2].bits;
+    CHECK(h.exec("drop dup 7 swap poke dup peek") == E_OK);
+    CHECK(h.stack[h.si-1].bits == 7);
+
+    // Resizing keeps the contents, and freed memory can be allocated again
+    CHECK(h.exec("drop 1000 resize drop dup peek swap free drop 1000 allocate drop") == E_OK);
+    CHECK(h.stack[h.si-2].bits == 7);
+    CHECK(h.exec("drop drop") == E_OK);
+    CHECK(h.exec("100000 allocate") == E_OK);
+    CHECK(h.stack[h.si-1].bits == E_OUT_OF_MEMORY);
+    CHECK(h.exec("drop drop") == E_OK);
+    CHECK(h.exec("here free") == E_INVALID_ADDRESS);
+    CHECK(h.exec(("7 " + std::to_string(a + 8) + " !").c_str()) == E_OK);
+
+    // Freed blocks merge, so the heap can be used up by small blocks and then by one large one
+    std::vector<char*> blocks;
+    char* block;
+    while(h.heap_allocate(40, block) == E_OK) {
+      blocks.push_back(block);
+    }
+    CHECK(blocks.size() > 40);
+    CHECK(h.heap_allocate(2500, block) == E_OUT_OF_MEMORY);
+    for(size_t i = 0; i < blocks.size(); i += 2) {
+      CHECK(h.heap_free(blocks[i]) == E_OK);
+    }
+    CHECK(h.heap_free(blocks[0]) == E_INVALID_ADDRESS);
+    for(size_t i = 1; i < blocks.size(); i += 2) {
+      CHECK(h.heap_free(blocks[i]) == E_OK);
+    }
+    CHECK(h.heap_allocate(2500, block) == E_OK);
+    CHECK(h.heap_resize(block, 2900) == E_OK);
+    CHECK(h.heap_allocate(1000, block) == E_OUT_OF_MEMORY);
+  }
+
+  SUBCASE("runs jobs on a pool of threads") {
+    Pool<StaticStateConfig<8, 8, 8, 100, 1024*4> > pool([](State& s) {
+      return s.exec(": square dup * ;");
+    }, 4);
+    CHECK(pool.setup_error == E_OK);
+
+    ptrdiff_t square = pool.word("square");
+    CHECK(square != -1);
+    CHECK(pool.word("+") == -1);
+
+    std::vector<std::future<JobResult> > squares;
+    for(ptrdiff_t i = 0; i != 100; i++) {
+      squares.push_back(pool.submit(square, {i}));
+    }
+    std::future<JobResult> defines = pool.submit(": cube dup square * ; cube", {3});
+    std::future<JobResult> fails = pool.submit("1 2 cube");
+
+    for(ptrdiff_t i = 0; i != 100; i++) {
+      JobResult r = squares[i].get();
+      CHECK(r.error == E_OK);
+      CHECK(r.stack.size() == 1);
+      CHECK(r.stack[0].bits == i * i);
+    }
+    JobResult r = defines.get();
+    CHECK(r.error == E_OK);
+    CHECK(r.stack[0].bits == 27);
+
+    // States are recycled between jobs, so one job's words aren't seen by another
+    r = fails.get();
+    CHECK(r.error == E_WORD_NOT_FOUND);
+    CHECK(r.stack.size() == 2);
+  }
+
+  SUBCASE("can suspend code on async C words") {
+    // Starts an operation for the host to finish, identified by its argument
+    s.defw("fetch", [](State& s) {
+      Cell key;
+      WF_CHECK(s.pop(key));
+      return s.suspend((void*) key.bits);
+    }, DictEntry::FLAG_ASYNC);
+    ptrdiff_t* code = 0;
+    CHECK(s.exec(": twice fetch swap fetch + ;") == E_OK);
+    CHECK(s.compile("1 2 twice 3 +", code) == E_OK);
+    CHECK((s.lookup("twice")->flags & DictEntry::FLAG_ASYNC) != 0);
+
+    // As an event loop would, finish each operation by pushing its result and resuming
+    size_t waits = 0;
+    Error e = s.exec(code, 0);
+    while(e == E_PENDING) {
+      waits++;
+      CHECK(s.push((ptrdiff_t) s.pending * 10) == E_OK);
+      e = s.resume();
+    }
+    CHECK(e == E_OK);
+    CHECK(waits == 2);
+    CHECK(s.si == 1);
+    CHECK(s.stack[0].bits == 33);
+    CHECK(s.ri == 0);
+
+    // The interpreter can't be suspended, so there is nothing to resume
+    CHECK(s.exec("5 fetch") == E_PENDING);
+    CHECK(s.resume() == E_INVALID_ADDRESS);
+  }
+
+#if WF_PREEMPT
+  SUBCASE("can preempt and resume code") {
+    CHECK(s.exec(": if 4 , here -1 , ; immediate : then here swap ! ; immediate") == E_OK);
+    CHECK(s.exec(": deep dup if 1 - deep 1 + then ; : run { a b } a 50 deep b + ; 3 4") == E_OK);
+    ptrdiff_t* run = (ptrdiff_t*) s.real_to_raddr(s.lookup("run")->data<ptrdiff_t>());
+
+    // Frames, locals and the stack are kept between slices
+    size_t slices = 1;
+    Error e = s.exec(run, 10);
+    while(e == E_YIELD) {
+      slices++;
+      e = s.resume(10);
+    }
+    CHECK(e == E_OK);
+    CHECK(slices > 20);
+    CHECK(s.si == 2);
+    CHECK(s.stack[0].bits == 3);
+    CHECK(s.stack[1].bits == 54);
+    CHECK(s.ri == 0);
+    CHECK(s.locals.i == 0);
+
+    // A runaway loop can be stopped
+    CHECK(s.exec(": forever 1 if forever then ; : start 1 2 { a b } forever a ;") == E_OK);
+    ptrdiff_t* start = (ptrdiff_t*) s.real_to_raddr(s.lookup("start")->data<ptrdiff_t>());
+    CHECK(s.exec(start, 1000) == E_YIELD);
+    CHECK(s.resume(1000) == E_YIELD);
+    CHECK(s.locals.i == 2);
+    s.cancel();
+    CHECK(s.ri == 0);
+    CHECK(s.locals.i == 0);
+    CHECK(s.resume(1000) == E_INVALID_ADDRESS);
+    CHECK(s.exec("2 2 +") == E_OK);
+  }
+#endif
+
+  SUBCASE("passes cells between threads through channels") {
+    SpscChannel spsc(4);
+    MpmcChannel mpmc(4);
+    ptrdiff_t handles[3] = {channel_register(spsc), channel_register(mpmc), 0};
+    handles[2] = handles[1];
+    CHECK(handles[0] != -1);
+    CHECK(handles[1] != -1);
+
+    const char* loops = ": if 4 , here -1 , ; immediate : then here swap ! ; immediate "
+      ": produce { ch n } n if n ch chan-send ch n 1 - produce then ; "
+      ": consume { ch n } n if ch chan-recv + ch n 1 - consume then ;";
+
+    // One producer on the SPSC channel and two on the MPMC one
+    TestState producers[3];
+    std::thread threads[3];
+    for(size_t i = 0; i != 3; i++) {
+      State& p = producers[i].state;
+      CHECK(defchannel_words(p) == E_OK);
+      CHECK(defchannel(p, "chan", handles[i]) == E_OK);
+      CHECK(p.exec(loops) == E_OK);
+      threads[i] = std::thread([&p] {
+        ptrdiff_t* code = 0;
+        CHECK(p.compile("chan 1000 produce", code) == E_OK);
+        CHECK((code && channel_exec(p, code) == E_OK));
+      });
+    }
+
+    // With room for the code it compiles
+    StaticStateConfig<8, 8, 8, 100, 1024*8> ccfg;
+    State c(ccfg);
+    CHECK(defchannel_words(c) == E_OK);
+    CHECK(defchannel(c, "spsc", handles[0]) == E_OK);
+    CHECK(defchannel(c, "mpmc", handles[1]) == E_OK);
+    CHECK(c.exec(loops) == E_OK);
+    ptrdiff_t* code = 0;
+    REQUIRE(c.compile("0 spsc 1000 consume 0 mpmc 2000 consume", code) == E_OK);
+    CHECK(channel_exec(c, code) == E_OK);
+    for(std::thread& t : threads) {
+      t.join();
+    }
+    CHECK(c.si == 2);
+    CHECK(c.stack[0].bits == 500500);
+    CHECK(c.stack[1].bits == 1001000);
+
+    CHECK(c.exec("mpmc chan-try-recv") == E_OK);
+    CHECK(c.stack[c.si-1].bits == 0);
+    CHECK(c.exec("5 spsc chan-try-send spsc chan-try-recv") == E_OK);
+    CHECK(c.stack[c.si-3].bits == 1);
+    CHECK(c.stack[c.si-2].bits == 5);
+    CHECK(c.stack[c.si-1].bits == 1);
+    CHECK(c.exec("99999 chan-recv") == E_OUT_OF_RANGE);
+
+    // A full channel suspends the sender, which finishes sending once resumed with room
+    c.si = 0;
+    REQUIRE(c.compile("spsc 5 produce", code) == E_OK);
+    CHECK(c.exec(code, 0) == E_PENDING);
+    CHECK(c.pending == &spsc);
+    CHECK(c.si == 2);
+    CHECK(c.stack[0].bits == 1);
+    CHECK(c.resume() == E_PENDING);
+    Cell x;
+    CHECK(spsc.try_recv(x));
+    CHECK(x.bits == 5);
+    CHECK(c.resume() == E_OK);
+    CHECK(c.si == 0);
+
+    // Likewise an empty channel suspends the receiver
+    REQUIRE(c.compile("0 spsc 5 consume", code) == E_OK);
+    CHECK(c.exec(code, 0) == E_PENDING);
+    CHECK(c.si == 2);
+    CHECK(c.stack[0].bits == 10);
+    CHECK(spsc.try_send(Cell(6)));
+    CHECK(c.resume() == E_OK);
+    CHECK(c.si == 1);
+    CHECK(c.stack[0].bits == 16);
+
+    // The interpreter can't be suspended
+    c.si = 0;
+    CHECK(c.exec("spsc chan-recv") == E_PENDING);
+
+    channel_unregister(handles[0]);
+    channel_unregister(handles[1]);
+    CHECK(c.exec("spsc chan-recv") == E_OUT_OF_RANGE);
+  }
+
   SUBCASE("can loop") {
 
   }
@@ -0,0 +1,291 @@
+// woof-channel.h - bounded channels of cells for passing messages between States on different threads
+#ifndef _WF_CHANNEL_H
+#define _WF_CHANNEL_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "woof.h"
+
+/**
+ * Maximum number of channels registered for Forth code at once, across all States
+ */
+#ifndef WF_CHANNELS
+# define WF_CHANNELS 256
+#endif
+
+namespace woof {
+
+/**
+ * A bounded queue of cells. Sending and receiving never take a lock; the blocking versions, for
+ * host threads, spin, then yield to other threads, until they can go ahead
+ */
+struct Channel {
+  virtual ~Channel() {}
+
+  /** Send a cell, or return false if the channel is full */
+  virtual bool try_send(Cell c) = 0;
+
+  /** Receive a cell, or return false if the channel is empty */
+  virtual bool try_recv(Cell& c) = 0;
+
+  /** Send a cell, waiting while the channel is full */
+  void send(Cell c) {
+    for(size_t spins = 0; !try_send(c); spins++) {
+      backoff(spins);
+    }
+  }
+
+  /** Receive a cell, waiting while the channel is empty */
+  Cell recv() {
+    Cell c;
+    for(size_t spins = 0; !try_recv(c); spins++) {
+      backoff(spins);
+    }
+    return c;
+  }
+
+  /** Busy wait briefly, since the other side is usually about to catch up, then give up the core */
+  static void backoff(size_t spins) {
+    if(spins >= 64) {
+      std::this_thread::yield();
+    }
+  }
+
+  /** Round a capacity up to a power of two, so positions wrap with a mask */
+  static size_t capacity_mask(size_t capacity) {
+    size_t size = 1;
+    while(size < capacity) {
+      size *= 2;
+    }
+    return size - 1;
+  }
+};
+
+/**
+ * A channel with one sending thread and one receiving thread. Each side keeps its own position and
+ * a cached copy of the other's, so it only reads the other side's cache line when it seems full or
+ * empty
+ */
+struct SpscChannel : Channel {
+  SpscChannel(size_t capacity):
+    mask(capacity_mask(capacity)), cells(new Cell[mask + 1]), tail(0), head_cache(0), head(0), tail_cache(0) {}
+
+  bool try_send(Cell c) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if(t - head_cache > mask) {
+      head_cache = head.load(std::memory_order_acquire);
+      if(t - head_cache > mask) {
+        return false;
+      }
+    }
+    cells[t & mask] = c;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_recv(Cell& c) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if(h == tail_cache) {
+      tail_cache = tail.load(std::memory_order_acquire);
+      if(h == tail_cache) {
+        return false;
+      }
+    }
+    c = cells[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  const size_t mask;
+  std::unique_ptr<Cell[]> cells;
+
+  // Written by the sender
+  alignas(64) std::atomic<size_t> tail;
+  size_t head_cache;
+
+  // Written by the receiver
+  alignas(64) std::atomic<size_t> head;
+  size_t tail_cache;
+};
+
+/**
+ * A channel any number of threads can send to and receive from. Each slot has a sequence number
+ * saying whether it is ready to be written or read at a given position, so threads only contend
+ * on claiming a position (see Dmitry Vyukov's bounded MPMC queue)
+ */
+struct MpmcChannel : Channel {
+  MpmcChannel(size_t capacity): mask(capacity_mask(capacity)), slots(new Slot[mask + 1]), tail(0), head(0) {
+    for(size_t i = 0; i <= mask; i++) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool try_send(Cell c) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    Slot* slot;
+    for(;;) {
+      slot = &slots[pos & mask];
+      ptrdiff_t diff = (ptrdiff_t) slot->sequence.load(std::memory_order_acquire) - (ptrdiff_t) pos;
+      if(diff == 0) {
+        if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if(diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    slot->cell = c;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_recv(Cell& c) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    Slot* slot;
+    for(;;) {
+      slot = &slots[pos & mask];
+      ptrdiff_t diff = (ptrdiff_t) slot->sequence.load(std::memory_order_acquire) - (ptrdiff_t) (pos + 1);
+      if(diff == 0) {
+        if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if(diff < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+    c = slot->cell;
+    slot->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  struct Slot {
+    std::atomic<size_t> sequence;
+    Cell cell;
+  };
+
+  const size_t mask;
+  std::unique_ptr<Slot[]> slots;
+  alignas(64) std::atomic<size_t> tail;
+  alignas(64) std::atomic<size_t> head;
+};
+
+/** Channels registered for Forth code, which refers to them by their index */
+inline std::atomic<Channel*>* channel_table() {
+  static std::atomic<Channel*> table[WF_CHANNELS];
+  return table;
+}
+
+/** Make a channel available to Forth code, returning its handle, or -1 if the table is full */
+inline ptrdiff_t channel_register(Channel& c) {
+  for(ptrdiff_t i = 0; i != WF_CHANNELS; i++) {
+    Channel* expected = 0;
+    if(channel_table()[i].compare_exchange_strong(expected, &c)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** Remove a channel from the table. No State may be using it */
+inline void channel_unregister(ptrdiff_t handle) {
+  if(handle >= 0 && handle < WF_CHANNELS) {
+    channel_table()[handle].store(0);
+  }
+}
+
+/** Look up the channel whose handle is i cells down the stack, leaving it there */
+inline Error channel_pick(State& s, ptrdiff_t i, Channel*& c) {
+  Cell handle;
+  WF_CHECK(s.pick(i, handle));
+  c = handle.bits >= 0 && handle.bits < WF_CHANNELS ? channel_table()[handle.bits].load(std::memory_order_acquire) : 0;
+  return c ? E_OK : s.errorf(E_OUT_OF_RANGE, "%ld is not a channel", handle.bits);
+}
+
+/** Pop a channel handle and look it up */
+inline Error channel_pop(State& s, Channel*& c) {
+  Cell handle;
+  WF_CHECK(channel_pick(s, 0, c));
+  return s.pop(handle);
+}
+
+/**
+ * Define the channel words in a State:
+ * chan-send ( x chan -- ) and chan-recv ( chan -- x ) suspend the code calling them while the
+ * channel is full or empty, with the channel as State::pending, and go ahead once it is resumed
+ * and the other side has made progress (see channel_exec). Code run by the interpreter can't be
+ * suspended, so there they fail with E_PENDING instead.
+ * chan-try-send ( x chan -- flag ) and chan-try-recv ( chan -- x flag ) never wait
+ */
+inline Error defchannel_words(State& s) {
+  WF_CHECK(s.defw("chan-send", [](State& s) {
+    Channel* c;
+    Cell x;
+    WF_CHECK(channel_pick(s, 0, c));
+    WF_CHECK(s.pick(1, x));
+    if(!c->try_send(x)) {
+      return s.suspend_retry(c);
+    }
+    WF_CHECK(s.pop(x));
+    return s.pop(x);
+  }, DictEntry::FLAG_ASYNC + DictEntry::effect(2, 0)));
+
+  WF_CHECK(s.defw("chan-recv", [](State& s) {
+    Channel* c;
+    Cell x;
+    WF_CHECK(channel_pick(s, 0, c));
+    if(!c->try_recv(x)) {
+      return s.suspend_retry(c);
+    }
+    s.stack[s.si-1] = x;
+    return E_OK;
+  }, DictEntry::FLAG_ASYNC + DictEntry::effect(1, 1)));
+
+  WF_CHECK(s.defw("chan-try-send", [](State& s) {
+    Channel* c;
+    Cell x;
+    WF_CHECK(channel_pop(s, c));
+    WF_CHECK(s.pop(x));
+    return s.push(c->try_send(x));
+  }, DictEntry::effect(2, 1)));
+
+  return s.defw("chan-try-recv", [](State& s) {
+    Channel* c;
+    Cell x;
+    WF_CHECK(channel_pop(s, c));
+    bool ok = c->try_recv(x);
+    WF_CHECK(s.push(x));
+    return s.push(ok);
+  }, DictEntry::effect(1, 2));
+}
+
+/**
+ * Run code until it finishes, resuming it whenever it suspends on a full or empty channel. This
+ * waits on the calling thread; a host with an event loop would run other States meanwhile
+ */
+inline Error channel_exec(State& s, ptrdiff_t* code) {
+  Error e = s.exec(code, 0);
+  for(size_t spins = 0; e == E_PENDING && s.pending_retry; spins++) {
+    Channel::backoff(spins);
+    e = s.resume();
+  }
+  return e;
+}
+
+/** Define a word that pushes the handle of a registered channel */
+inline Error defchannel(State& s, const char* name, ptrdiff_t handle) {
+  DictEntry* d;
+  WF_CHECK(s.create(name, d));
+  WF_CHECK(s.dict_put(OP_PUSH_IMMEDIATE));
+  WF_CHECK(s.dict_put(handle));
+  return s.dict_put(OP_EXIT);
+}
+
+}; // namespace woof
+
+#endif
@@ -0,0 +1,204 @@
+// woof-pool.h - runs independent jobs on a pool of worker threads, each with a State of its own
+#ifndef _WF_POOL_H
+#define _WF_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "woof.h"
+
+namespace woof {
+
+/** What a job left behind: its error, the message in scratch if it failed, and its data stack */
+struct JobResult {
+  Error error;
+  std::string message;
+  std::vector<Cell> stack;
+};
+
+/**
+ * A pool of worker threads that run Forth on States layered on one shared base, see
+ * StateConfig::base. The base is set up once, and every job starts from a State fresh from it with
+ * its input cells on the stack, so jobs can't see each other. Jobs are queued per worker and idle
+ * workers steal from the others, so a few long jobs don't hold up short ones queued behind them
+ */
+template <class Config = GrowableStateConfig<> >
+struct Pool {
+  /**
+   * Set up the base with setup, e.g. to load a prelude and define C++ words, then start threads
+   * workers. If setup fails, no workers are started and setup_error says why
+   */
+  Pool(std::function<Error(State&)> setup, size_t threads = std::thread::hardware_concurrency()):
+    base(base_cfg), stopping(false), queued(0), next(0) {
+    setup_error = setup(base);
+    if(setup_error != E_OK) {
+      return;
+    }
+    for(size_t i = 0; i != (threads ? threads : 1); i++) {
+      workers.emplace_back(new Worker(base));
+    }
+    for(size_t i = 0; i != workers.size(); i++) {
+      workers[i]->thread = std::thread(&Pool::work, this, i);
+    }
+  }
+
+  /** Finish queued jobs, then stop the workers */
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for(auto& w : workers) {
+      w->thread.join();
+    }
+  }
+
+  Pool(const Pool&) = delete;
+  Pool& operator=(const Pool&) = delete;
+
+  /** Handle of a Forth word in the base, to run without parsing its name, or -1 if there isn't one */
+  ptrdiff_t word(const char* name) const {
+    DictEntry* d = base.lookup(name);
+    if(!d || (d->flags & DictEntry::FLAG_CWORD)) {
+      return -1;
+    }
+    return base.real_to_raddr(d->data<ptrdiff_t>());
+  }
+
+  /** Run source with input on the stack */
+  std::future<JobResult> submit(const std::string& source, const std::vector<Cell>& input = {}) {
+    return submit(Job{source, -1, input, std::promise<JobResult>()});
+  }
+
+  /** Run a word from Pool::word with input on the stack */
+  std::future<JobResult> submit(ptrdiff_t word, const std::vector<Cell>& input = {}) {
+    return submit(Job{std::string(), word, input, std::promise<JobResult>()});
+  }
+
+  Error setup_error;
+
+ private:
+  struct Job {
+    std::string source;
+    ptrdiff_t word;
+    std::vector<Cell> input;
+    std::promise<JobResult> result;
+  };
+
+  struct Worker {
+    Worker(const State& base) {
+      cfg.base = &base;
+      state.reset(new State(cfg));
+    }
+
+    Config cfg;
+    std::unique_ptr<State> state;
+    std::thread thread;
+
+    /** Jobs queued on this worker. It takes from the front and thieves take from the back */
+    std::mutex mutex;
+    std::deque<Job> jobs;
+  };
+
+  std::future<JobResult> submit(Job&& job) {
+    std::future<JobResult> future = job.result.get_future();
+    if(workers.empty()) {
+      job.result.set_value(JobResult{setup_error, "pool failed to set up", {}});
+      return future;
+    }
+
+    Worker& w = *workers[next++ % workers.size()];
+    {
+      std::lock_guard<std::mutex> lock(w.mutex);
+      w.jobs.push_back(std::move(job));
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      queued++;
+    }
+    wake.notify_one();
+    return future;
+  }
+
+  /** Take a job from worker i's queue, or steal one from another worker's */
+  bool take(size_t i, Job& job) {
+    for(size_t n = 0; n != workers.size(); n++) {
+      Worker& w = *workers[(i + n) % workers.size()];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      if(w.jobs.empty()) {
+        continue;
+      }
+      if(n == 0) {
+        job = std::move(w.jobs.front());
+        w.jobs.pop_front();
+      } else {
+        job = std::move(w.jobs.back());
+        w.jobs.pop_back();
+      }
+      queued--;
+      return true;
+    }
+    return false;
+  }
+
+  void work(size_t i) {
+    Worker& w = *workers[i];
+    for(;;) {
+      Job job;
+      if(!take(i, job)) {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return stopping || queued != 0; });
+        if(stopping && queued == 0) {
+          return;
+        }
+        continue;
+      }
+      job.result.set_value(run(w, job));
+    }
+  }
+
+  JobResult run(Worker& w, Job& job) {
+    State& s = *w.state;
+    JobResult r;
+    r.error = job.input.size() > s.stack_size ? E_STACK_OVERFLOW : E_OK;
+    if(r.error == E_OK) {
+      for(const Cell& c : job.input) {
+        s.push(c);
+      }
+      r.error = job.word == -1 ? s.exec(job.source.c_str()) : s.exec((ptrdiff_t*) job.word);
+      r.stack.assign(s.stack, s.stack + s.si);
+    }
+    if(r.error != E_OK) {
+      r.message = s.scratch;
+    }
+
+    // Recycle the State for the next job, dropping whatever this one defined
+    w.state.reset();
+    w.state.reset(new State(w.cfg));
+    return r;
+  }
+
+  Config base_cfg;
+  State base;
+  std::vector<std::unique_ptr<Worker> > workers;
+
+  /** Idle workers sleep on wake until a job is queued or the pool stops */
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  bool stopping;
+  std::atomic<size_t> queued;
+  std::atomic<size_t> next;
+};
+
+}; // namespace woof
+
+#endif
@@ -3,13 +3,30 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-// TODO This is only available under certain compilers
-#define WF_COMPUTED_GOTO 1
+/**
+ * Dispatch VM instructions through a table of label addresses rather than a switch. Requires the
+ * GCC/Clang labels as values extension
+ */
+#ifndef WF_COMPUTED_GOTO
+# define WF_COMPUTED_GOTO 1
+#endif
+
+/**
+ * Count every instruction executed by the VM in State::instruction_count, for benchmarking
+ */
+#ifndef WF_COUNT_INSTRUCTIONS
+# define WF_COUNT_INSTRUCTIONS 0
+#endif
 
 // Logs for debugging, if needed
 
@@ -41,6 +58,81 @@
 #define WF_CHECKF(e, ...) do { woof::Error err = e; if(err != E_OK) { return errorf(err, __VA_ARGS__); }} while(0)
 #define WF_FN_CHECKF(f, e, ...) do { woof::Error err = e; if(err != E_OK) { return (s).errorf(err, __VA_ARGS__); }} while(0)
 
+/**
+ * Unsafe mode -- removes the checks made by the virtual machine and stack primitives on every
+ * instruction: stack underflow, address and C word validation, and errors returned by C words
+ * called from Forth code. Only for running trusted code, mistakes will crash rather than return
+ * an error
+ */
+#ifndef WF_UNSAFE
+# define WF_UNSAFE 0
+#endif
+
+/**
+ * Verifier -- checks the bytecode of words as ; finishes them, and of images and compiled handles
+ * as they are loaded, so the VM can skip address, C word and local checks while running them.
+ * Unsafe mode skips those checks for all code, so it has no use for the verifier
+ */
+#ifndef WF_VERIFY
+# define WF_VERIFY (!WF_UNSAFE)
+#endif
+
+/**
+ * JIT -- compiles words to x86-64 machine code when ; finishes them. Words the JIT can't handle
+ * are left to the bytecode interpreter. Requires an x86-64 system with mmap
+ */
+#ifndef WF_JIT
+# define WF_JIT 0
+#endif
+
+/**
+ * Bytes of executable memory to reserve for machine code, and the number of compiled words the
+ * table of them starts with room for. The table grows as needed
+ */
+#ifndef WF_JIT_SIZE
+# define WF_JIT_SIZE (4 * 1024 * 1024)
+#endif
+
+#ifndef WF_JIT_WORDS
+# define WF_JIT_WORDS 4096
+#endif
+
+/**
+ * Keep the top of the data stack in a local variable in the VM loop, rather than in memory
+ */
+#ifndef WF_STACK_CACHE
+# define WF_STACK_CACHE 1
+#endif
+
+/**
+ * Profiler -- counts instructions executed by the VM and calls to each word, and times words.
+ * Enabled at runtime with profile-on. Words compiled by the JIT are only seen as calls into them
+ */
+#ifndef WF_PROFILE
+# define WF_PROFILE 0
+#endif
+
+/**
+ * Number of words the profiler can keep track of
+ */
+#ifndef WF_PROFILE_WORDS
+# define WF_PROFILE_WORDS 256
+#endif
+
+#if WF_PROFILE
+# include <stdint.h>
+# include <time.h>
+#endif
+
+/**
+ * Preemption -- lets the host run Forth code for a budget of VM instructions and resume it later,
+ * see State::exec(ptrdiff_t*, size_t). Costs a countdown on every instruction, and words aren't
+ * compiled by the JIT, since machine code can't be stopped partway through
+ */
+#ifndef WF_PREEMPT
+# define WF_PREEMPT 0
+#endif
+
 /**
  * Size of scratch buffer to use for things like formatting strings and reading input
  */
@@ -48,6 +140,13 @@
 # define WF_SCRATCH_SIZE 512
 #endif
 
+/**
+ * Size of the buffer used to read source from files and streams a chunk at a time
+ */
+#ifndef WF_INPUT_CHUNK_SIZE
+# define WF_INPUT_CHUNK_SIZE 4096
+#endif
+
 /**
  * Number of pointers to share between C++ and Forth
  */
@@ -55,12 +154,33 @@
 # define WF_SHARED_SIZE 8
 #endif
 
+/**
+ * Number of buckets in the dictionary lookup index. Must be a power of two
+ */
+#ifndef WF_INDEX_SIZE
+# define WF_INDEX_SIZE 512
+#endif
+
 namespace woof {
 
 inline size_t align(int boundary, size_t value) {
   return (size_t)((value + (boundary - 1)) & -boundary);
 }
 
+/** Index of the highest set bit of a non-zero value */
+inline size_t log2_floor(size_t value) {
+  return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(value);
+}
+
+/** FNV-1a hash of a word name */
+inline size_t hash_name(const char* name) {
+  size_t h = 2166136261u;
+  for(; *name; name++) {
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  }
+  return h;
+}
+
 struct State;
 
 /**
@@ -108,6 +228,12 @@ enum Error {
   E_COMPILE_ONLY,
   E_EXPECTED_FORTH_WORD,
   E_EXPECTED_C_WORD,
+  /** Failed to open or read a file */
+  E_IO,
+  /** Code ran out of instruction budget, and can be resumed */
+  E_YIELD,
+  /** A C word started an operation that hasn't finished. Code can be resumed once it has */
+  E_PENDING,
 };
 
 inline const char* error_description(const Error e) {
@@ -124,6 +250,9 @@ inline const char* error_description(const Error e) {
     case E_COMPILE_ONLY: return "invoked compile only word from interpreter";
     case E_EXPECTED_FORTH_WORD: return "expected forth word";
     case E_EXPECTED_C_WORD: return "expected c word";
+    case E_IO: return "i/o error";
+    case E_YIELD: return "yielded";
+    case E_PENDING: return "pending";
     default: return "unknown";
   }
 }
@@ -150,7 +279,7 @@ struct Stack {
 
 
   Error push(ptrdiff_t w) {
-    if(i > size) {
+    if(i >= size) {
       // TODO return which stack this happened on
       return E_OUT_OF_MEMORY;
     }
@@ -161,12 +290,111 @@ struct Stack {
   }
 };
 
+#if WF_PROFILE
+/**
+ * Calls and time spent in a word, in nanoseconds
+ */
+struct ProfileWord {
+  /** Relative address of a Forth word's code, or a C word's index */
+  ptrdiff_t key;
+  bool cword;
+  size_t calls;
+  /** Time from entry to exit, counted once for recursive calls */
+  uint64_t inclusive;
+  /** Time excluding Forth words it called */
+  uint64_t exclusive;
+  /** Number of calls currently running */
+  size_t active;
+};
+
+/**
+ * A Forth word being profiled by the VM
+ */
+struct ProfileFrame {
+  /** Null if the word isn't being profiled */
+  ProfileWord* word;
+  uint64_t start;
+  /** Start of the last call the word made */
+  uint64_t call_start;
+  /** Time spent in words it called */
+  uint64_t children;
+};
+#endif
+
+/**
+ * A return stack entry, saved by the VM when calling into another Forth word
+ */
+struct Frame {
+  /** Code and instruction pointer to return to */
+  ptrdiff_t* code;
+  size_t ip;
+  /** Locals stack index at entry of the calling word, restored when it exits */
+  size_t locals_i;
+#if WF_VERIFY
+  /** Whether the calling word was verified, so it runs unchecked again when the VM returns to it */
+  bool verified;
+  /** Whether the calling word's stack use was checked on entry, see State::verify_bound */
+  bool bounded;
+#endif
+#if WF_PROFILE
+  ProfileFrame profile;
+#endif
+};
+
+/**
+ * Header of a block in a State's heap, followed by its data. Blocks lie end to end, and sizes are
+ * multiples of ALIGN, which leaves the low bits of size for flags. Free blocks keep their free list
+ * links where their data would be
+ */
+struct HeapBlock {
+  enum {
+    FREE = 1,
+    /** The block just before this one is free, and previous says where it is */
+    PREVIOUS_FREE = 2,
+    FLAGS = FREE | PREVIOUS_FREE,
+
+    ALIGN = 2 * sizeof(size_t),
+    ALIGN_LOG = sizeof(size_t) == 8 ? 4 : 3,
+    HEADER = 2 * sizeof(size_t),
+    MIN = 4 * sizeof(size_t),
+
+    /**
+     * Free blocks are kept in lists by size class. Blocks smaller than SMALL get a class every
+     * ALIGN bytes, each power of two above that is split into SL_COUNT classes
+     */
+    SL_LOG = 4,
+    SL_COUNT = 1 << SL_LOG,
+    FL_SHIFT = SL_LOG + ALIGN_LOG,
+    SMALL = 1 << FL_SHIFT,
+    FL_COUNT = 40,
+  };
+
+  /** Offset in the heap of the previous block, only kept while it's free */
+  size_t previous;
+  size_t size;
+  size_t next_free, previous_free;
+
+  size_t bytes() const { return size & ~(size_t) FLAGS; }
+
+  /** Size class of a block */
+  static void classify(size_t size, size_t& fl, size_t& sl) {
+    if(size < SMALL) {
+      fl = 0;
+      sl = size / ALIGN;
+    } else {
+      size_t f = log2_floor(size);
+      fl = f - FL_SHIFT + 1;
+      sl = (size >> (f - SL_LOG)) ^ SL_COUNT;
+    }
+  }
+};
+
 /**
  * StateConfig -- a struct used to initialize State and point it at 
  * whatever memory you've allocated for it.
  */
 struct StateConfig {
-  StateConfig() {}
+  StateConfig(): memory_grow(0), memory_grow_ctx(0), heap(0), heap_size(0), base(0), memory_i(0), si(0), guard_size(0) {}
   ~StateConfig() {}
 
   // REFACTOR pointer to an array of values
@@ -176,42 +404,216 @@ struct StateConfig {
   char* memory;
   size_t memory_size;
 
+  /**
+   * Optional hook called when memory runs out, e.g. to commit more of a reserved mapping. It must
+   * make at least size bytes usable without moving memory, and returns the new size, or 0 if it
+   * can't. Memory it adds must be zeroed
+   */
+  size_t (*memory_grow)(void* ctx, size_t size);
+  void* memory_grow_ctx;
+
+  /**
+   * Optional memory for the heap words allocate, free and resize, kept apart from the dictionary so
+   * freeing doesn't disturb here. It must lie above memory, and its addresses are used by Forth
+   * code like any others. Its contents don't need clearing
+   */
+  char* heap;
+  size_t heap_size;
+
   // REFACTOR pointer to an array of values
   Cell* shared;
   size_t shared_size;
 
   Stack locals;
   Stack cwords;
+
+  /** Return stack; bounds the depth of Forth calls */
+  Frame* rstack;
+  size_t rstack_size;
+
+  /**
+   * Optional base dictionary, shared read-only with any number of other States, including ones in
+   * other threads. A State layered on it starts with its words and shared variables, and memory
+   * only holds what it defines itself. The base must outlive its layers, must not be changed or
+   * compiled into while they exist, and can't itself have a base. shared and cwords must be at
+   * least as large as the base's
+   */
+  const State* base;
+
+  /**
+   * Used memory and stack depth, set by State::clone_into. If memory_i is not 0 a State created
+   * from this config takes memory, stack, shared and cwords as they are rather than starting empty
+   */
+  size_t memory_i;
+  size_t si;
+
+  /**
+   * Bytes of inaccessible memory just below and above stack, locals and rstack, or 0 if there are
+   * none. The VM then lets stack ops run into them rather than checking bounds, and turns the
+   * resulting faults into errors. See GuardedStateConfig
+   */
+  size_t guard_size;
 };
 
 
 /** 
  * A convenience method for struct StateConfig with statically allocated memory
  */
-template <size_t stack_size_num = 1024, size_t shared_size_num = 8, size_t locals_size_num = 256, size_t cwords_size_num = 128, size_t memory_size_num = 1024 * 1024>
+template <size_t stack_size_num = 1024, size_t shared_size_num = 8, size_t locals_size_num = 256, size_t cwords_size_num = 128, size_t memory_size_num = 1024 * 1024, size_t rstack_size_num = 1024, size_t heap_size_num = 0>
 struct StaticStateConfig : StateConfig {
   StaticStateConfig() {
-    stack = (Cell*) stack_store;
+    stack = stack_store;
     stack_size = stack_size_num;
 
-    memory = (char*) memory_store;
+    memory = memory_store;
     memory_size = memory_size_num;
 
+    heap = heap_size_num ? heap_store : 0;
+    heap_size = heap_size_num;
+
+    locals.data = locals_store;
+    locals.size = locals_size_num;
+
+    cwords.data = cwords_store;
+    cwords.size = cwords_size_num;
+
+    shared = shared_store;
+    shared_size = shared_size_num;
+
+    rstack = rstack_store;
+    rstack_size = rstack_size_num;
+  }
+
+  Cell stack_store[stack_size_num];
+  alignas(Cell) char memory_store[memory_size_num];
+  // After memory_store, since the heap must lie above memory
+  alignas(2 * sizeof(Cell)) char heap_store[heap_size_num ? heap_size_num : 1];
+  ptrdiff_t locals_store[locals_size_num];
+  ptrdiff_t cwords_store[cwords_size_num];
+  Cell shared_store[shared_size_num];
+  Frame rstack_store[rstack_size_num];
+};
+
+/**
+ * A StateConfig whose memory is a reserved mapping of up to max_memory_size bytes, committed as the
+ * State uses it. Memory never moves, so growing it doesn't disturb pointers into it, and untouched
+ * pages cost nothing. The heap, of heap_size bytes, is mapped just above the most memory can grow
+ * to, and its pages are likewise only backed once used. If the mapping fails memory_size is 0 and
+ * every allocation fails
+ */
+template <size_t stack_size_num = 1024, size_t shared_size_num = 8, size_t locals_size_num = 256, size_t cwords_size_num = 128, size_t rstack_size_num = 1024>
+struct GrowableStateConfig : StateConfig {
+  GrowableStateConfig(size_t max_memory_size_ = 1024 * 1024 * 1024, size_t initial_size = 64 * 1024, size_t heap_size_ = 256 * 1024 * 1024) {
+    stack = stack_store;
+    stack_size = stack_size_num;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    max_memory_size = align(page_size, max_memory_size_);
+    heap_size = align(page_size, heap_size_);
+    memory = (char*) mmap(0, max_memory_size + heap_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(memory == MAP_FAILED) {
+      memory = 0;
+      max_memory_size = 0;
+      heap_size = 0;
+    }
+    // A State ignores heap_size while heap is 0, and the destructor needs it to unmap
+    heap = heap_size && mprotect(memory + max_memory_size, heap_size, PROT_READ | PROT_WRITE) == 0 ? memory + max_memory_size : 0;
+    memory_size = 0;
+    memory_grow = grow;
+    memory_grow_ctx = this;
+    grow(this, initial_size);
+
     locals.data = locals_store;
     locals.size = locals_size_num;
 
     cwords.data = cwords_store;
     cwords.size = cwords_size_num;
 
-    shared = (Cell*) shared_store;
+    shared = shared_store;
     shared_size = shared_size_num;
+
+    rstack = rstack_store;
+    rstack_size = rstack_size_num;
+  }
+
+  ~GrowableStateConfig() {
+    if(memory) {
+      munmap(memory, max_memory_size + heap_size);
+    }
+  }
+
+  GrowableStateConfig(const GrowableStateConfig&) = delete;
+  GrowableStateConfig& operator=(const GrowableStateConfig&) = delete;
+
+  /** Commit at least size bytes, at least doubling what is committed to keep system calls rare */
+  static size_t grow(void* ctx, size_t size) {
+    GrowableStateConfig* cfg = (GrowableStateConfig*) ctx;
+    size_t want = align(cfg->page_size, size > cfg->memory_size * 2 ? size : cfg->memory_size * 2);
+    if(want > cfg->max_memory_size) {
+      want = cfg->max_memory_size;
+    }
+    if(want < size || mprotect(cfg->memory, want, PROT_READ | PROT_WRITE) != 0) {
+      return 0;
+    }
+    cfg->memory_size = want;
+    return want;
   }
 
-  Cell* stack_store[stack_size_num];
-  char* memory_store[memory_size_num];
+  size_t page_size, max_memory_size;
+
+  Cell stack_store[stack_size_num];
   ptrdiff_t locals_store[locals_size_num];
   ptrdiff_t cwords_store[cwords_size_num];
-  Cell* shared_store[shared_size_num];
+  Cell shared_store[shared_size_num];
+  Frame rstack_store[rstack_size_num];
+};
+
+/**
+ * A GrowableStateConfig whose data, locals and return stacks are mapped with a page of
+ * inaccessible memory at either end. Sizes are rounded up to fill whole pages. Going past either
+ * end of a stack faults, and exec turns the fault into E_STACK_UNDERFLOW or E_STACK_OVERFLOW, so
+ * the VM doesn't have to check bounds on every stack op. If a mapping fails the State gets
+ * one-cell stacks without guard pages
+ */
+template <size_t stack_size_num = 1024, size_t shared_size_num = 8, size_t locals_size_num = 256, size_t cwords_size_num = 128, size_t rstack_size_num = 1024>
+struct GuardedStateConfig : GrowableStateConfig<1, shared_size_num, 1, cwords_size_num, 1> {
+  GuardedStateConfig(size_t max_memory_size_ = 1024 * 1024 * 1024, size_t initial_size = 64 * 1024, size_t heap_size_ = 256 * 1024 * 1024):
+      GrowableStateConfig<1, shared_size_num, 1, cwords_size_num, 1>(max_memory_size_, initial_size, heap_size_) {
+    size_t stack_bytes = align(this->page_size, stack_size_num * sizeof(Cell)),
+      locals_bytes = align(this->page_size, locals_size_num * sizeof(ptrdiff_t)),
+      rstack_bytes = align(this->page_size, rstack_size_num * sizeof(Frame));
+    mapping_size = this->page_size * 6 + stack_bytes + locals_bytes + rstack_bytes;
+    mapping = (char*) mmap(0, mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mapping == MAP_FAILED) {
+      mapping = 0;
+      return;
+    }
+    char* stack_at = mapping + this->page_size;
+    char* locals_at = stack_at + stack_bytes + this->page_size * 2;
+    char* rstack_at = locals_at + locals_bytes + this->page_size * 2;
+    if(mprotect(stack_at, stack_bytes, PROT_READ | PROT_WRITE) != 0 ||
+        mprotect(locals_at, locals_bytes, PROT_READ | PROT_WRITE) != 0 ||
+        mprotect(rstack_at, rstack_bytes, PROT_READ | PROT_WRITE) != 0) {
+      return;
+    }
+    this->stack = (Cell*) stack_at;
+    this->stack_size = stack_bytes / sizeof(Cell);
+    this->locals.data = (ptrdiff_t*) locals_at;
+    this->locals.size = locals_bytes / sizeof(ptrdiff_t);
+    // Frames don't divide a page evenly, so the last one is the one up against the guard page
+    this->rstack_size = rstack_bytes / sizeof(Frame);
+    this->rstack = (Frame*) (rstack_at + rstack_bytes) - this->rstack_size;
+    this->guard_size = this->page_size;
+  }
+
+  ~GuardedStateConfig() {
+    if(mapping) {
+      munmap(mapping, mapping_size);
+    }
+  }
+
+  char* mapping;
+  size_t mapping_size;
 };
 
 /**
@@ -223,6 +625,14 @@ struct String {
   char bytes[1];
 };
 
+/**
+ * How a word uses the data stack: cells it takes, cells it leaves, and the most cells it holds at
+ * once, counting the ones it took
+ */
+struct StackEffect {
+  uint16_t in, out, peak;
+};
+
 /** 
  * An entry in the Forth dictionary
  */
@@ -233,12 +643,43 @@ struct DictEntry {
     FLAG_CWORD = 1 << 2,
     FLAG_HIDDEN = 1 << 3,
     FLAG_COMPILE_ONLY = 1 << 4,
+    /** C word that the compiler can replace with a native opcode, stored after the cword index */
+    FLAG_OPCODE = 1 << 5,
+    /**
+     * C word that may suspend the code calling it with State::suspend, or a Forth word that calls
+     * one. The JIT leaves these as bytecode, since machine code can't be suspended
+     */
+    FLAG_ASYNC = 1 << 6,
+    /** C word with a declared stack effect, held in the bits from EFFECT_SHIFT. See effect */
+    FLAG_EFFECT = 1 << 7,
+    /**
+     * C word that takes the next word of input as its argument by returning E_WANT_WORD, like :
+     * and variable. State::compile can't compile these. Uses the free low bit, below the effect
+     */
+    FLAG_READS_INPUT = 1 << 0,
   };
 
+  enum { EFFECT_SHIFT = 8 };
+
+  /**
+   * Flags for defw declaring that a C word takes in cells from the stack and leaves out cells
+   * there, so the verifier can work out the stack use of words calling it
+   */
+  static size_t effect(unsigned in, unsigned out) {
+    return FLAG_EFFECT + ((size_t) (in & 0xff) << EFFECT_SHIFT) + ((size_t) (out & 0xff) << (EFFECT_SHIFT + 8));
+  }
+
+  /**
+   * Relative address of the previous dictionary entry, or -1 if none. Links are relative addresses
+   * so that the dictionary still works when copied somewhere else in memory, and so that private
+   * entries can link to entries in a base dictionary. Followed with State::dict_follow
+   */
+  ptrdiff_t previous;
+
   /**
-   * The previous dictionary entry (if any)
+   * Relative address of the previous dictionary entry in the same lookup index bucket, or -1 if none
    */
-  DictEntry* previous;
+  ptrdiff_t bucket_previous;
 
   /**
    * Flags on the word
@@ -309,7 +750,165 @@ enum Opcode {
   OP_LOCAL_SET = 8,
   /** Exit current word */
   OP_EXIT = 9,
+
+  /* Native versions of builtin C words, emitted by the compiler in place of OP_CALL_C */
+
+  OP_ADD = 10,
+  OP_SUB = 11,
+  OP_MUL = 12,
+  OP_GT = 13,
+  OP_EQ = 14,
+  OP_MOD = 15,
+  OP_DUP = 16,
+  OP_DROP = 17,
+  OP_SWAP = 18,
+  /** @ */
+  OP_FETCH = 19,
+  /** ! */
+  OP_STORE = 20,
+
+  /** Call another Forth word in place of the current one, emitted by ; for a call right before OP_EXIT */
+  OP_TAIL_CALL = 21,
+  /**
+   * Run a word compiled to machine code, then exit. Followed by an index into the JIT's words.
+   * Replaces the first instruction of words compiled by the JIT
+   */
+  OP_NATIVE = 22,
+
+  /** Number of opcodes */
+  OP_COUNT
+};
+
+inline const char* opcode_description(ptrdiff_t op) {
+  switch(op) {
+    case OP_PUSH_IMMEDIATE: return "OP_PUSH_IMMEDIATE";
+    case OP_CALL_FORTH: return "OP_CALL_FORTH";
+    case OP_CALL_C: return "OP_CALL_C";
+    case OP_JUMP_IF_ZERO: return "OP_JUMP_IF_ZERO";
+    case OP_JUMP: return "OP_JUMP";
+    case OP_JUMP_IGNORED: return "OP_JUMP_IGNORED";
+    case OP_LOCAL_PUSH: return "OP_LOCAL_PUSH";
+    case OP_LOCAL_SET: return "OP_LOCAL_SET";
+    case OP_EXIT: return "OP_EXIT";
+    case OP_ADD: return "OP_ADD";
+    case OP_SUB: return "OP_SUB";
+    case OP_MUL: return "OP_MUL";
+    case OP_GT: return "OP_GT";
+    case OP_EQ: return "OP_EQ";
+    case OP_MOD: return "OP_MOD";
+    case OP_DUP: return "OP_DUP";
+    case OP_DROP: return "OP_DROP";
+    case OP_SWAP: return "OP_SWAP";
+    case OP_FETCH: return "OP_FETCH";
+    case OP_STORE: return "OP_STORE";
+    case OP_TAIL_CALL: return "OP_TAIL_CALL";
+    case OP_NATIVE: return "OP_NATIVE";
+    default: return 0;
+  }
+}
+
+/** Whether an instruction is followed by an operand */
+inline bool opcode_has_operand(ptrdiff_t op) {
+  switch(op) {
+    case OP_PUSH_IMMEDIATE: case OP_CALL_FORTH: case OP_CALL_C: case OP_JUMP_IF_ZERO: case OP_JUMP:
+    case OP_JUMP_IGNORED: case OP_LOCAL_PUSH: case OP_TAIL_CALL: case OP_NATIVE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+#if WF_PROFILE
+/**
+ * Everything collected by the profiler
+ */
+struct Profile {
+  /** Instructions executed by opcode */
+  size_t opcodes[OP_COUNT];
+  /** Open addressed table of words that have been called */
+  ProfileWord words[WF_PROFILE_WORDS];
+  /** Calls not counted because words was full */
+  size_t dropped;
+};
+#endif
+
+#if WF_JIT
+/**
+ * A minimal x86-64 instruction encoder for the JIT. Memory operands always use a 32-bit
+ * displacement, which wastes some space but keeps encoding simple
+ */
+struct Assembler {
+  enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+  Assembler(unsigned char* code_, size_t size_): code(code_), i(0), size(size_), overflow(false) {}
+
+  unsigned char* code;
+  size_t i, size;
+  /** Set if code did not fit */
+  bool overflow;
+
+  void byte(unsigned b) {
+    if(i == size) {
+      overflow = true;
+      return;
+    }
+    code[i++] = (unsigned char) b;
+  }
+
+  void u32(uint32_t v) { for(int j = 0; j != 4; j++) byte((v >> (j * 8)) & 0xff); }
+  void u64(uint64_t v) { for(int j = 0; j != 8; j++) byte((v >> (j * 8)) & 0xff); }
+
+  /** One or two byte opcode, prefixed with REX.W and register extension bits */
+  void op(unsigned opcode, int reg, int index, int base) {
+    byte(0x48 | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+    if(opcode > 0xff) byte(opcode >> 8);
+    byte(opcode & 0xff);
+  }
+
+  /** opcode reg, [base + disp] */
+  void mem(unsigned opcode, int reg, int base, int32_t disp) {
+    op(opcode, reg, 0, base);
+    byte(0x80 | ((reg & 7) << 3) | (base & 7));
+    // rsp and r12 can only be used as a base through a SIB byte
+    if((base & 7) == RSP) byte(0x24);
+    u32(disp);
+  }
+
+  /** opcode reg, [base + index * (1 << scale) + disp] */
+  void mem_index(unsigned opcode, int reg, int base, int index, int scale, int32_t disp) {
+    op(opcode, reg, index, base);
+    byte(0x84 | ((reg & 7) << 3));
+    byte((scale << 6) | ((index & 7) << 3) | (base & 7));
+    u32(disp);
+  }
+
+  /** opcode dst, src for opcodes taking r/m as the first operand. src is the /digit for groups */
+  void reg(unsigned opcode, int dst, int src) {
+    op(opcode, src, 0, dst);
+    byte(0xc0 | ((src & 7) << 3) | (dst & 7));
+  }
+
+  /** mov reg, imm64 */
+  void mov_imm(int reg, uint64_t imm) {
+    op(0xb8 + (reg & 7), 0, 0, reg);
+    u64(imm);
+  }
+
+  /** Jump or call to an offset relative to code. Returns the position of the displacement */
+  size_t rel32(unsigned opcode, ptrdiff_t target) {
+    if(opcode > 0xff) byte(opcode >> 8);
+    byte(opcode & 0xff);
+    size_t at = i;
+    u32((uint32_t) (target - (ptrdiff_t) (at + 4)));
+    return at;
+  }
+
+  void patch(size_t at, ptrdiff_t target) {
+    int32_t rel = (int32_t) (target - (ptrdiff_t) (at + 4));
+    if(at + 4 <= size) memcpy(&code[at], &rel, 4);
+  }
 };
+#endif
 
 /**
  * An instance of Forth. Self-contained and re-entrant
@@ -319,75 +918,169 @@ struct State {
     stack(cfg.stack),
     stack_size(cfg.stack_size),
     si(0),
-    memory(cfg.memory),
+    // Memory is indexed by relative address, and a layered State's own memory starts where its
+    // base's ends
+    memory(cfg.base ? cfg.memory - cfg.base->memory_i : cfg.memory),
     memory_i(0),
-    memory_size(cfg.memory_size),
+    memory_size(cfg.base ? cfg.base->memory_i + cfg.memory_size : cfg.memory_size),
+    memory_grow(cfg.memory_grow),
+    memory_grow_ctx(cfg.memory_grow_ctx),
+    scratch_i(0),
+    last_call_i(0),
+    compile_start_i(0),
+    compile_async(false),
+    optimizing(true),
+    base(cfg.base),
+    base_memory(cfg.base ? cfg.base->memory : 0),
+    base_i(cfg.base ? cfg.base->memory_i : 0),
     shared(cfg.shared),
     shared_size(cfg.shared_size),
     locals(cfg.locals),
     cwords(cfg.cwords),
-    scratch_i(0) {
-      // Zero out memory
-      memset(stack, 0, stack_size * sizeof(Cell));
-      memset(memory, 0, memory_size);
+    rstack(cfg.rstack),
+    rstack_size(cfg.rstack_size),
+    ri(0),
+    guard_size(cfg.guard_size) {
       memset(scratch, 0, WF_SCRATCH_SIZE);
+
+      input = 0;
+      input_i = input_size = 0;
+      input_read = 0;
+      input_ctx = 0;
+      input_error = false;
+
+#if WF_JIT
+      jit_memory = 0;
+      jit_i = 0;
+      jit_words_i = 0;
+      jit_table = 0;
+      jit_table_size = 0;
+      jit_rx = 0;
+      jit_page = 0;
+      jit_enter = 0;
+      jit_stack_limit = 0;
+#endif
+#if WF_COUNT_INSTRUCTIONS
+      instruction_count = 0;
+#endif
+#if WF_PREEMPT
+      budget = 0;
+#endif
+      suspendable = false;
+      suspended.code = 0;
+      suspended_rbase = 0;
+      pending = 0;
+      pending_retry = false;
+      work = 0;
+      work_size = 0;
+#if WF_VERIFY
+      verify_bits = 0;
+      verify_chunks = 0;
+      verify_end = 0;
+      verify_epoch = 0;
+      verify_stale = false;
+      verify_effects = 0;
+      verify_effects_i = 0;
+      verify_effects_size = 0;
+      verify_cword_effects = 0;
+      verify_cwords_i = 0;
+#endif
+      heap_reset(cfg.heap, cfg.heap ? cfg.heap_size : 0);
+      if(guard_size) {
+        guard_install();
+      }
+#if WF_PROFILE
+      profiling = false;
+      profile_reset();
+#endif
+
+      if(cfg.memory_i) {
+        // Adopt the dictionary copied by clone_into
+        memory_i = cfg.memory_i;
+        si = cfg.si;
+        index_rebuild();
+#if WF_VERIFY
+        verify_all();
+#endif
+        return;
+      }
+
+      // Zero out memory. allot clears memory as it hands it out, so only the cell at memory_i,
+      // which can be read before then, needs clearing
+      memset(stack, 0, stack_size * sizeof(Cell));
+      memset(&memory[base_i], 0, memory_size - base_i < sizeof(Cell) ? memory_size - base_i : sizeof(Cell));
       memset(shared, 0, shared_size * sizeof(Cell));
+      memset(index, 0, sizeof(index));
       cwords.zero();
       locals.zero();
 
+      if(base) {
+        // Start with the base's words, builtins included
+        WF_ASSERT(!base->base && shared_size >= base->shared_size && cwords.size >= base->cwords.i);
+        memory_i = base_i;
+        memcpy(shared, base->shared, base->shared_size * sizeof(Cell));
+        memcpy(cwords.data, base->cwords.data, base->cwords.i * sizeof(ptrdiff_t));
+        cwords.i = base->cwords.i;
+        memcpy(index, base->index, sizeof(index));
+        return;
+      }
+
       /***** BUILTIN WORDS */
 
       /***** ARITHMETIC / COMPARISON */
 
       cwords.push(0);
 
-      defw("+", [](State& s) {
+      defop(OP_ADD, "+", [](State& s) {
         // REFACTOR plain numbers
         Cell a, b;
         WF_CHECK(s.pop(a));
         WF_CHECK(s.pop(b));
         return s.push(b.bits + a.bits);
-      });
+      }, DictEntry::effect(2, 1));
 
-      defw("*", [](State& s) {
+      defop(OP_MUL, "*", [](State& s) {
         // REFACTOR plain numbers
         Cell a, b;
         WF_CHECK(s.pop(a));
         WF_CHECK(s.pop(b));
         return s.push(a.bits * b.bits);
-      });
+      }, DictEntry::effect(2, 1));
 
-      defw("-", [](State& s) {
+      defop(OP_SUB, "-", [](State& s) {
         // REFACTOR plain numbers
         Cell a, b;
         WF_CHECK(s.pop(a));
         WF_CHECK(s.pop(b));
         return s.push(b.bits - a.bits);
-      });
+      }, DictEntry::effect(2, 1));
 
-      defw(">", [](State& s) {
+      defop(OP_GT, ">", [](State& s) {
         // REFACTOR plain numbers
         Cell a, b;
         WF_CHECK(s.pop(a));
         WF_CHECK(s.pop(b));
         return s.push(b.bits > a.bits ? -1 : 0);
-      });
+      }, DictEntry::effect(2, 1));
 
-      defw("=", [](State& s) {
+      defop(OP_EQ, "=", [](State& s) {
         // REFACTOR plain numbers
         Cell a, b;
         WF_CHECK(s.pop(a));
         WF_CHECK(s.pop(b));
         return s.push(b.bits == a.bits);
-      });
+      }, DictEntry::effect(2, 1));
 
-      defw("%", [](State& s) {
+      defop(OP_MOD, "%", [](State& s) {
         // REFACTOR plain numbers
         Cell a, b;
         WF_CHECK(s.pop(a));
         WF_CHECK(s.pop(b));
+        if(a.bits == 0) {
+          return E_DIVIDE_BY_ZERO;
+        }
         return s.push(b.bits % a.bits);
-      });
+      }, DictEntry::effect(2, 1));
 
       /***** I/O */
       defw(".", [](State& s) {
@@ -396,7 +1089,7 @@ struct State {
         WF_CHECK(s.pop(x));
         printf("%ld\n", x.bits);
         return E_OK;
-      });
+      }, DictEntry::effect(1, 0));
 
       defw(".s", [](State& s) {
         // REFACTOR plain numbers
@@ -405,7 +1098,7 @@ struct State {
         }
         printf("\n");
         return E_OK;
-      });
+      }, DictEntry::effect(0, 0));
 
       defw("fmt", [](State& s) {
         // REFACTOR using cell for multiple purposes
@@ -459,14 +1152,40 @@ struct State {
         s.shared[S_COMPILING] = 1;
 
         DictEntry* d = 0;
-        return s.create(s.scratch, d);
-      });
+        WF_CHECK(s.create(s.scratch, d));
+        s.compile_start_i = s.memory_i;
+        s.compile_async = false;
+        return E_OK;
+      }, DictEntry::FLAG_READS_INPUT);
 
       defw(";", [](State& s) {
+        // A call immediately followed by exit can reuse the current frame
+        if(s.last_call_i != 0 && s.last_call_i + (2 * sizeof(ptrdiff_t)) == s.memory_i) {
+          ptrdiff_t* call = (ptrdiff_t*) &s.memory[s.last_call_i];
+          if(*call == OP_CALL_FORTH) {
+            WF_LOG(WF_CC, "tail call @ " << s.last_call_i);
+            *call = OP_TAIL_CALL;
+          }
+        }
+
         WF_CHECK(s.dict_put(OP_EXIT));
         s.shared[S_COMPILING] = 0;
+        if(s.optimizing) {
+          s.optimize(s.compile_start_i);
+        }
+#if WF_VERIFY
+        s.verify(s.compile_start_i, s.memory_i);
+#endif
+
+        // Words calling async words can suspend too
+        if(s.compile_async) {
+          s.shared[S_LATEST].as<DictEntry>()->flags |= DictEntry::FLAG_ASYNC;
+          return E_OK;
+        }
 
-        DictEntry* latest = s.shared[S_LATEST].as<DictEntry>();
+#if WF_JIT
+        s.jit_word(s.compile_start_i, s.memory_i);
+#endif
 
         return E_OK;
       }, DictEntry::FLAG_IMMEDIATE + DictEntry::FLAG_COMPILE_ONLY);
@@ -475,6 +1194,7 @@ struct State {
       // in compiler mode
       defw("immediate", [](State& s) {
         DictEntry *d = s.shared[S_LATEST].as<DictEntry>();
+        WF_FN_CHECKF(s, s.in_base(d) ? E_INVALID_ADDRESS : E_OK, "can't change a word in the base dictionary");
         if((d->flags & DictEntry::FLAG_IMMEDIATE) == 0) {
           d->flags += DictEntry::FLAG_IMMEDIATE;
         }
@@ -484,6 +1204,7 @@ struct State {
       // Marks a word as compile-only
       defw("compile-only", [](State& s) {
         DictEntry* d = s.shared[S_LATEST].as<DictEntry>();
+        WF_FN_CHECKF(s, s.in_base(d) ? E_INVALID_ADDRESS : E_OK, "can't change a word in the base dictionary");
         if((d-> flags & DictEntry::FLAG_COMPILE_ONLY) == 0) {
           d->flags += DictEntry::FLAG_COMPILE_ONLY;
         }
@@ -497,7 +1218,7 @@ struct State {
         WF_CHECK(s.dict_put(c));
         // Write something to here and bump it 
         return E_OK;
-      });
+      }, DictEntry::effect(1, 0));
 
       defw("{", [](State& s) {
         // return want word until } is encountered, then stop wanting word
@@ -579,12 +1300,74 @@ struct State {
         s.shared[S_WORD_AVAILABLE] = 0;
 
         return E_OK;
+      }, DictEntry::FLAG_READS_INPUT);
+
+      // Restore the checkpoint at an address, the code of a marker
+      defw("(marker)", [](State& s) {
+        Cell addr;
+        WF_CHECK(s.pop(addr));
+        WF_CHECK(s.raddr_valid(addr.as<ptrdiff_t>()));
+        WF_CHECK(s.raddr_valid(addr.as<ptrdiff_t>() + 2));
+        State::Checkpoint cp = State::Checkpoint();
+        ptrdiff_t* saved = s.raddr_to_real(addr.as<ptrdiff_t>());
+        cp.memory_i = saved[0];
+        cp.latest = saved[1];
+        cp.cwords_i = saved[2];
+        return s.restore(cp);
       });
 
+      // marker name defines name, which forgets itself and everything defined after it
+      defw("marker", [](State& s) {
+        if(*s.shared[S_WORD_AVAILABLE] == 0) {
+          return E_WANT_WORD;
+        }
+        s.shared[S_WORD_AVAILABLE] = 0;
+
+        State::Checkpoint cp = s.checkpoint();
+        DictEntry* d = 0;
+        WF_CHECK(s.create(s.scratch, d));
+        WF_CHECK(s.dict_put(OP_PUSH_IMMEDIATE));
+        ptrdiff_t* pushaddr = (ptrdiff_t*) &s.memory[s.memory_i];
+        WF_CHECK(s.dict_put(-5));
+        WF_CHECK(s.dict_put_cword("(marker)"));
+        WF_CHECK(s.dict_put(OP_EXIT));
+        (*pushaddr) = s.real_to_raddr((ptrdiff_t*) &s.memory[s.memory_i]);
+        WF_CHECK(s.dict_put(cp.memory_i));
+        WF_CHECK(s.dict_put(cp.latest));
+        return s.dict_put(cp.cwords_i);
+      }, DictEntry::FLAG_READS_INPUT);
+
+      // forget name forgets name and everything defined after it
+      defw("forget", [](State& s) {
+        if(*s.shared[S_WORD_AVAILABLE] == 0) {
+          return E_WANT_WORD;
+        }
+        s.shared[S_WORD_AVAILABLE] = 0;
+
+        DictEntry* d = s.lookup(s.scratch);
+        if(!d) return E_WORD_NOT_FOUND;
+
+        State::Checkpoint cp = State::Checkpoint();
+        WF_CHECK(s.checkpoint_before(d, cp));
+        return s.restore(cp);
+      }, DictEntry::FLAG_READS_INPUT);
+
+      // Interpret a Forth source file, e.g. include examples/fib.fs
+      defw("include", [](State& s) {
+        if(*s.shared[S_WORD_AVAILABLE] == 0) {
+          return E_WANT_WORD;
+        }
+        s.shared[S_WORD_AVAILABLE] = 0;
+
+        // Interpreting the file reuses scratch
+        char path[WF_SCRATCH_SIZE];
+        memcpy(path, s.scratch, WF_SCRATCH_SIZE);
+        return s.include(path);
+      }, DictEntry::FLAG_READS_INPUT);
 
       /***** MEMORY MANIPULATION */
 
-      defw("!", [](State& s) {
+      defop(OP_STORE, "!", [](State& s) {
         // Store data at address
         // REFACTOR this converts a value to an raddr to a real pointer
         Cell addrcell, data;
@@ -593,14 +1376,17 @@ struct State {
 
         // TODO(raddr): writing directly to memory address
         ptrdiff_t *real, *raddr = addrcell.as<ptrdiff_t>();
-        WF_CHECK(s.raddr_valid(raddr));
+        WF_CHECK(s.raddr_writable(raddr));
+#if WF_VERIFY
+        s.verify_store((ptrdiff_t) raddr);
+#endif
 
         real = s.raddr_to_real(raddr);
 
         (*real) = data.bits;
 
         return E_OK;
-      });
+      }, DictEntry::effect(2, 0));
 
       defw("allot", [](State& s) {
         Cell bytes;
@@ -612,19 +1398,50 @@ struct State {
         // Difference from forth: allot returns the address of the thing it just allocated, seems
         // more convenient than having to save and shuffle HERE
         return s.push(relative);
-      });
+      }, DictEntry::effect(1, 1));
+
+      // allocate, free and resize follow ANS Forth, leaving an ior that is 0 or an Error. Addresses
+      // that didn't come from allocate are still errors
+      defw("allocate", [](State& s) {
+        Cell bytes;
+        WF_CHECK(s.pop(bytes));
+        ptrdiff_t* addr;
+        Error e = s.heap_allocate(*bytes, addr);
+        WF_CHECK(s.push(e == E_OK ? s.real_to_raddr(addr) : 0));
+        return s.push(e);
+      }, DictEntry::effect(1, 2));
+
+      defw("free", [](State& s) {
+        Cell addr;
+        WF_CHECK(s.pop(addr));
+        WF_CHECK(s.heap_free(s.raddr_to_real(addr.as<ptrdiff_t>())));
+        return s.push(E_OK);
+      }, DictEntry::effect(1, 1));
+
+      defw("resize", [](State& s) {
+        Cell addr, bytes;
+        WF_CHECK(s.pop(bytes));
+        WF_CHECK(s.pop(addr));
+        ptrdiff_t* real = s.raddr_to_real(addr.as<ptrdiff_t>());
+        Error e = s.heap_resize(real, *bytes);
+        if(e != E_OK && e != E_OUT_OF_MEMORY) {
+          return e;
+        }
+        WF_CHECK(s.push(s.real_to_raddr(real)));
+        return s.push(e);
+      }, DictEntry::effect(2, 2));
 
       defw("here", [](State& s) {
         s.push(s.memory_i);
         return E_OK;
-      });
+      }, DictEntry::effect(0, 1));
 
       defw("WORD", [](State& s) {
         s.push(sizeof(ptrdiff_t));
         return E_OK;
-      });
+      }, DictEntry::effect(0, 1));
 
-      defw("@", [](State& s) {
+      defop(OP_FETCH, "@", [](State& s) {
         Cell addrcell;
         WF_CHECK(s.pop(addrcell));
 
@@ -633,27 +1450,27 @@ struct State {
         ptrdiff_t* real = s.raddr_to_real(raddr);
 
         return s.push(*real);
-      });
+      }, DictEntry::effect(1, 1));
 
       /***** STACK MANIPULATION WORDS */
 
-      defw("dup", [](State& s) {
+      defop(OP_DUP, "dup", [](State& s) {
         Cell c;
         WF_CHECK(s.pick(0, c));
         return s.push(c);
-      });
+      }, DictEntry::effect(1, 2));
 
-      defw("drop", [](State& s) {
+      defop(OP_DROP, "drop", [](State& s) {
         return s.drop(1);
-      });
+      }, DictEntry::effect(1, 0));
 
-      defw("swap", [](State& s) {
+      defop(OP_SWAP, "swap", [](State& s) {
         Cell a, b;
         WF_CHECK(s.pop(a));
         WF_CHECK(s.pop(b));
         WF_CHECK(s.push(a));
         return s.push(b);
-      });
+      }, DictEntry::effect(2, 2));
 
       defw("\'", [](State& s) {
         if(*s.shared[S_WORD_AVAILABLE] == 0) {
@@ -671,6 +1488,17 @@ struct State {
 
         return s.push((ptrdiff_t) s.real_to_raddr(d->data<ptrdiff_t>()));
 
+        return E_OK;
+      }, DictEntry::FLAG_READS_INPUT);
+
+      // Whether ; optimizes the words it finishes, e.g. to compare their code with decompile
+      defw("optimize-on", [](State& s) {
+        s.optimizing = true;
+        return E_OK;
+      });
+
+      defw("optimize-off", [](State& s) {
+        s.optimizing = false;
         return E_OK;
       });
 
@@ -679,39 +1507,35 @@ struct State {
       // from addr to OP_EXIT
       defw("decompile", [](State& s) {
         Cell addrcell;
-        // TODO: Check validity of address
         WF_CHECK(s.pop(addrcell));
+        WF_FN_CHECKF(s, s.raddr_valid((ptrdiff_t*) addrcell.bits), "decompile got invalid address %ld", addrcell.bits);
         ptrdiff_t* code = s.raddr_to_real((ptrdiff_t*) addrcell.bits);
         size_t ip = 0;
         bool loop = true;
+#if WF_JIT
+        // The first instruction of a jitted word is replaced with OP_NATIVE, read the original
+        ptrdiff_t* word = code;
+        const ptrdiff_t* saved = s.jit_saved(word);
+        if(saved) {
+          printf("OP_NATIVE @ %ld (%ld) jitted\n", (ptrdiff_t) word, word[1]);
+        }
+# define WF_DECOMPILE_CELL(i) ((saved && &code[i] - word >= 0 && &code[i] - word < 2) ? saved[&code[i] - word] : code[i])
+#else
+# define WF_DECOMPILE_CELL(i) code[i]
+#endif
         while(loop) {
           ptrdiff_t opaddr = (ptrdiff_t) &code[ip];
-          ptrdiff_t op = code[ip++];
+          // An instruction and its operand, if it has one, must both be in the dictionary
+          WF_FN_CHECKF(s, s.raddr_valid((ptrdiff_t*) s.real_to_raddr(&code[ip + 1])), "decompile ran past the dictionary @ %ld", opaddr);
+          ptrdiff_t op = WF_DECOMPILE_CELL(ip);
+          ip++;
 
           switch(op) {
-            case OP_PUSH_IMMEDIATE: {
-              printf("OP_PUSH_IMMEDIATE @ %ld (%ld)\n", opaddr, code[ip++]);
-              break;
-            }
-            case OP_CALL_FORTH: {
-              printf("OP_CALL_FORTH @ %ld (%ld)\n", opaddr, code[ip++]);
-              break;
-            }
-            case OP_CALL_C: {
-              printf("OP_CALL_C @ %ld (%ld)\n", opaddr, code[ip++]);
-              break;
-            }
-            case OP_JUMP_IF_ZERO: {
-              printf("OP_JUMP_IF_ZERO @ %ld (%ld)\n", opaddr, code[ip++]);
-              break;
-            }
-            case OP_JUMP: {
-              printf("OP_JUMP @ %ld (%ld)\n", opaddr, code[ip++]);
-              break;
-            }
             case OP_JUMP_IGNORED: {
-              printf("OP_JUMP_IGNORED @ %ld (%ld)\n", opaddr, code[ip++]);
-              code = (ptrdiff_t*) s.raddr_to_real((ptrdiff_t*) code[ip-1]);
+              ptrdiff_t label = WF_DECOMPILE_CELL(ip);
+              printf("OP_JUMP_IGNORED @ %ld (%ld)\n", opaddr, label);
+              WF_FN_CHECKF(s, s.raddr_valid((ptrdiff_t*) label), "decompile got invalid jump to %ld", label);
+              code = (ptrdiff_t*) s.raddr_to_real((ptrdiff_t*) label);
               ip = 0;
               break;
             }
@@ -720,14 +1544,21 @@ struct State {
               loop = false;
               break;
             }
-            case OP_LOCAL_PUSH: {
-              printf("OP_LOCAL_PUSH @ %ld (%ld)\n", opaddr, code[ip++]);
-              break;
-            }
             case OP_LOCAL_SET: {
               printf("OP_LOCAL_SET\n");
               break;
             }
+            case OP_PUSH_IMMEDIATE: case OP_CALL_FORTH: case OP_CALL_C: case OP_JUMP_IF_ZERO:
+            case OP_JUMP: case OP_LOCAL_PUSH: case OP_TAIL_CALL: case OP_NATIVE: {
+              printf("%s @ %ld (%ld)\n", opcode_description(op), opaddr, WF_DECOMPILE_CELL(ip));
+              ip++;
+              break;
+            }
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_GT: case OP_EQ: case OP_MOD:
+            case OP_DUP: case OP_DROP: case OP_SWAP: case OP_FETCH: case OP_STORE: {
+              printf("%s @ %ld\n", opcode_description(op), opaddr);
+              break;
+            }
             case OP_UNKNOWN: default: {
               printf("E_INVALID_OPCODE @ %ld %ld\n", opaddr, op);
               loop = false;
@@ -735,10 +1566,57 @@ struct State {
             }
           }
         }
+#undef WF_DECOMPILE_CELL
+        return E_OK;
+      });
+
+#if WF_PROFILE
+      /***** PROFILER */
+
+      defw("profile-on", [](State& s) {
+        s.profiling = true;
+        return E_OK;
+      });
+
+      defw("profile-off", [](State& s) {
+        s.profiling = false;
+        return E_OK;
+      });
+
+      defw("profile-reset", [](State& s) {
+        s.profile_reset();
+        return E_OK;
+      });
+
+      defw("profile-report", [](State& s) {
+        s.profile_report(stdout);
         return E_OK;
       });
+#endif
+    }
+
+  ~State() {
+#if WF_JIT
+    if(jit_memory) {
+      munmap(jit_memory, WF_JIT_SIZE);
+      munmap(jit_table, jit_table_size * sizeof(JitWord));
+    }
+#endif
+    if(work) {
+      munmap(work, work_size * sizeof(uint32_t));
+    }
+#if WF_VERIFY
+    if(verify_bits) {
+      munmap(verify_bits, verify_bits_size(verify_chunks));
+    }
+    if(verify_effects) {
+      munmap(verify_effects, verify_effects_size * sizeof(VerifiedEffect));
+    }
+    if(verify_cword_effects) {
+      munmap(verify_cword_effects, cwords.size * sizeof(uint32_t));
     }
-  ~State() {}
+#endif
+  }
 
   /**
    * The data stack
@@ -752,15 +1630,113 @@ struct State {
   char *memory;
   size_t memory_i, memory_size;
 
+  /** See StateConfig::memory_grow */
+  size_t (*memory_grow)(void* ctx, size_t size);
+  void* memory_grow_ctx;
+
   /**
    * Scratch buffer, for doing things with strings
    */
   char scratch[WF_SCRATCH_SIZE];
   size_t scratch_i;
 
+  /** Memory index of the last OP_CALL_FORTH emitted by the compiler, for tail call elimination */
+  size_t last_call_i;
+
+  /** Memory index of the code of the word currently being compiled */
+  size_t compile_start_i;
+
+  /** Whether the word currently being compiled calls an async word, see DictEntry::FLAG_ASYNC */
+  bool compile_async;
+
+  /** Whether ; optimizes words, see optimize */
+  bool optimizing;
+
+  /**
+   * Base dictionary, see StateConfig::base. Its memory holds relative addresses [0, base_i) and is
+   * read only, memory holds [base_i, memory_i)
+   */
+  const State* base;
+  const char* base_memory;
+  size_t base_i;
+
+#if WF_COUNT_INSTRUCTIONS
+  /** Number of instructions executed by the VM */
+  size_t instruction_count;
+#endif
+
+#if WF_PREEMPT
+  /** Instructions the next call to exec_from may run before it yields, or 0 for no limit */
+  size_t budget;
+#endif
+  /** Whether the next call to exec_from may suspend, rather than code run by a C word */
+  bool suspendable;
+  /** Where suspended code stopped. code is 0 if nothing is suspended */
+  Frame suspended;
+  /** Return stack index below which frames belong to whoever ran the suspended code */
+  size_t suspended_rbase;
+  /** Token from the C word suspended code is waiting on, see suspend */
+  void* pending;
+  /** Whether that word runs again on resume, see suspend_retry */
+  bool pending_retry;
+  /** Scratch for passes over the code of one word, mapped on first use. See work_reserve */
+  uint32_t* work;
+  /** uint32_ts work has room for */
+  size_t work_size;
+
+#if WF_VERIFY
+  /**
+   * What the verifier has checked, one bit per cell-sized chunk of memory, mapped on first use. Each
+   * 64 chunks take a word of bits for cells that verified code relies on, so storing to them
+   * demotes it, then a word of bits for the starts of verified words
+   */
+  uint64_t* verify_bits;
+  /** Chunks verify_bits has room for */
+  size_t verify_chunks;
+  /** End of the last verified code, stores past it can't touch any */
+  size_t verify_end;
+  /** Counts demotions, so the VM can tell that a C word demoted the code it is running */
+  size_t verify_epoch;
+  /** Set by demotion, so the next definition verifies everything again */
+  bool verify_stale;
+
+  /** The stack effect of a verified word */
+  struct VerifiedEffect {
+    size_t start_i;
+    StackEffect effect;
+  };
+
+  /**
+   * Stack effects of verified words that have one, a table keyed by address with linear probing,
+   * mapped on first use. Its size is a power of two
+   */
+  VerifiedEffect* verify_effects;
+  size_t verify_effects_i, verify_effects_size;
+  /**
+   * Declared stack effects of C words by slot, filled from the dictionary when the verifier meets a
+   * slot it doesn't cover. Each is the word's flags shifted down by EFFECT_SHIFT, plus
+   * VERIFY_DECLARED, or 0 if it declared none
+   */
+  uint32_t* verify_cword_effects;
+  /** C word slots verify_cword_effects covers */
+  size_t verify_cwords_i;
+#endif
+
+#if WF_PROFILE
+  /** Whether the VM is collecting a profile */
+  bool profiling;
+  Profile profile;
+#endif
+
   Cell* shared;
   size_t shared_size;
 
+  /**
+   * Lookup index -- the latest dictionary entry for each bucket of name hashes, further entries
+   * are chained through DictEntry::bucket_previous
+   */
+  DictEntry* index[WF_INDEX_SIZE];
+
   /** Locals stack -- stores local variables during function execution */
   Stack locals;
   
@@ -770,11 +1746,35 @@ struct State {
    */
   Stack cwords;
 
+  /** Return stack -- frames of Forth words that are currently executing */
+  Frame* rstack;
+  size_t rstack_size, ri;
+
+  /** See StateConfig::guard_size */
+  size_t guard_size;
+
+  /**
+   * Heap, see StateConfig::heap. Free blocks are kept in lists by size class, with bitmaps of which
+   * lists have any, so allocating and freeing take constant time (see TLSF). Blocks cover
+   * heap_size bytes, and a header just past them marks the end
+   */
+  char* heap;
+  ptrdiff_t heap_raddr;
+  size_t heap_size;
+  uint64_t heap_fl_map;
+  uint32_t heap_sl_map[HeapBlock::FL_COUNT];
+  size_t heap_free_lists[HeapBlock::FL_COUNT][HeapBlock::SL_COUNT];
+
   /***** STACK INTERACTION PRIMITIVES */
 
   // TODO: If I used pointer/int types correctly, these functions could handle raddr conversions
 
   Error push(Cell v) {
+#if !WF_UNSAFE
+    if(si == stack_size) {
+      return E_STACK_OVERFLOW;
+    }
+#endif
     stack[si++] = v;
     return E_OK;    
   };
@@ -783,9 +1783,11 @@ struct State {
    * Pop a value into v
    */
   Error pop(Cell& v) {
+#if !WF_UNSAFE
     if(si == 0) {
       return E_STACK_UNDERFLOW;
     }
+#endif
 
     v = stack[si-1];
     si--;
@@ -796,9 +1798,11 @@ struct State {
    * Drop N values from the stack
    */
   Error drop(size_t n = 1) {
+#if !WF_UNSAFE
     if(si < n) {
       return E_STACK_UNDERFLOW;
     }
+#endif
     si -= n;
     return E_OK;
   }
@@ -807,9 +1811,11 @@ struct State {
    * Pick ith value off the stack (0 is top, 1 is one from the top etc)
    */
   Error pick(ptrdiff_t i, Cell& c) {
+#if !WF_UNSAFE
     if(i >= si) {
       return E_STACK_UNDERFLOW;
     }
+#endif
     c = stack[si-i-1];
     return E_OK;
   }
@@ -820,11 +1826,16 @@ struct State {
   Error cword_get(ptrdiff_t raddr, c_word_t& cw) {
     // cword virtual addresses should always be odd this allows us to distinguish them from forth
     // word addresses
+    ptrdiff_t actual_idx = (raddr + 1) / 2;
+#if WF_UNSAFE
+    cw = (c_word_t) cwords.data[actual_idx];
+    return E_OK;
+#else
     if((raddr % 2) == 0) {
       return E_INVALID_OPCODE;
     }
-    ptrdiff_t actual_idx = (raddr + 1) / 2;
     return cwords.get(actual_idx, cw);
+#endif
   }
 
   /***** SCRATCH INTERACTION */
@@ -863,42 +1874,290 @@ struct State {
 
   /***** DICTIONARY PRIMITIVES */
 
-  /** Check whether a relative address if valid */
+  /** Check whether a relative address if valid, i.e. is in the dictionary or the heap */
   Error raddr_valid(ptrdiff_t* addr) const {
     ptrdiff_t a = (ptrdiff_t) addr;
-    if(a < 0 || a > memory_i) {
+    if((size_t) a > memory_i && (size_t) (a - heap_raddr) >= heap_size) {
+      return E_INVALID_ADDRESS;
+    }
+    return E_OK;
+  }
+
+  /** Check whether a relative address is valid and can be written, i.e. is not in the base dictionary */
+  Error raddr_writable(ptrdiff_t* addr) const {
+    ptrdiff_t a = (ptrdiff_t) addr;
+    if((a < (ptrdiff_t) base_i || a > (ptrdiff_t) memory_i) && (size_t) (a - heap_raddr) >= heap_size) {
       return E_INVALID_ADDRESS;
     }
     return E_OK;
   }
 
+  /** Check whether a real pointer points into the base dictionary */
+  bool in_base(const void* real) const {
+    return (const char*) real >= base_memory && (const char*) real < base_memory + base_i;
+  }
+
   /** Convert a real pointer to a valid address */
   ptrdiff_t real_to_raddr(ptrdiff_t* real) const {
-    return (ptrdiff_t)real - (ptrdiff_t)memory; 
+    return (ptrdiff_t)real - (ptrdiff_t)(in_base(real) ? base_memory : memory);
   }
 
   /** Convert a relative address to a real pointer */
   ptrdiff_t* raddr_to_real(ptrdiff_t* ptr) const {
-    return (ptrdiff_t*) &memory[(ptrdiff_t)ptr];
+    return (ptrdiff_t*) &(((ptrdiff_t) ptr < (ptrdiff_t) base_i) ? base_memory : memory)[(ptrdiff_t)ptr];
+  }
+
+  /** Follow a link between dictionary entries */
+  DictEntry* dict_follow(ptrdiff_t link) const {
+    return link == -1 ? 0 : (DictEntry*) raddr_to_real((ptrdiff_t*) link);
   }
 
+  /** Make memory at least size bytes, growing it if the config allows */
+  Error memory_reserve(size_t size) {
+    if(size <= memory_size) {
+      return E_OK;
+    }
+    // The cell at memory_i can be read, so keep room for one past what was asked for
+    size_t own = size - base_i + sizeof(Cell);
+    size_t grown = memory_grow ? memory_grow(memory_grow_ctx, own) : 0;
+    if(grown < own) {
+      return E_OUT_OF_MEMORY;
+    }
+    memory_size = base_i + grown;
+    return E_OK;
+  }
 
   /**
    * Allocate some memory for general purpose use
    */
   template <class T>
   Error allot(size_t req, T*& addr) {
-    if(memory_i + req > memory_size) {
-      return E_OUT_OF_MEMORY;
-    }
+    WF_CHECK(memory_reserve(memory_i + req));
 
     addr = (T*) &memory[memory_i];
+    // Memory past memory_i isn't necessarily clear, e.g. in a State created by clone_into
+    memset(addr, 0, req);
 
     memory_i += req;
 
     return E_OK;
   }
 
+  /***** HEAP */
+
+  HeapBlock* heap_block(size_t offset) const {
+    return (HeapBlock*) &heap[offset];
+  }
+
+  /** Make the heap one free block covering size bytes of memory, dropping any allocations */
+  void heap_reset(char* memory_, size_t size) {
+    heap = (char*) align(HeapBlock::ALIGN, (size_t) memory_);
+    size_t skipped = heap - memory_;
+    size = size > skipped ? (size - skipped) & ~(size_t) (HeapBlock::ALIGN - 1) : 0;
+    // The end marker takes a header, and the largest block must have a size class
+    size_t largest = ((size_t) 1 << (HeapBlock::FL_COUNT + HeapBlock::FL_SHIFT - 1)) - HeapBlock::ALIGN;
+    heap_size = size < HeapBlock::MIN + HeapBlock::HEADER ? 0 : size - HeapBlock::HEADER;
+    heap_size = heap_size < largest ? heap_size : largest;
+    heap_raddr = heap - memory;
+    heap_fl_map = 0;
+    memset(heap_sl_map, 0, sizeof(heap_sl_map));
+    if(!heap_size) {
+      return;
+    }
+
+    heap_block(0)->size = heap_size;
+    heap_block(heap_size)->size = 0;
+    heap_release(0);
+  }
+
+  /**
+   * Check that a block found by following a link is where a block could be. Forth code can write
+   * over block headers, so the heap checks them before trusting them
+   */
+  bool heap_block_valid(size_t offset) const {
+    if(heap_size < HeapBlock::MIN || offset > heap_size - HeapBlock::MIN || (offset & (HeapBlock::ALIGN - 1))) {
+      return false;
+    }
+    size_t bytes = heap_block(offset)->bytes();
+    return bytes >= HeapBlock::MIN && bytes <= heap_size - offset;
+  }
+
+  /** Put a free block on the list for its size class */
+  void heap_insert(size_t offset) {
+    HeapBlock* b = heap_block(offset);
+    size_t fl, sl;
+    HeapBlock::classify(b->bytes(), fl, sl);
+    size_t& head = heap_free_lists[fl][sl];
+    b->next_free = (heap_sl_map[fl] & (1u << sl)) ? head : (size_t) -1;
+    b->previous_free = (size_t) -1;
+    if(b->next_free != (size_t) -1) {
+      heap_block(b->next_free)->previous_free = offset;
+    }
+    head = offset;
+    heap_fl_map |= (uint64_t) 1 << fl;
+    heap_sl_map[fl] |= 1u << sl;
+  }
+
+  /** Take a free block off its list */
+  Error heap_remove(size_t offset) {
+    HeapBlock* b = heap_block(offset);
+    if(!heap_block_valid(offset) || (b->next_free != (size_t) -1 && !heap_block_valid(b->next_free)) ||
+        (b->previous_free != (size_t) -1 && !heap_block_valid(b->previous_free))) {
+      return errorf(E_INVALID_ADDRESS, "heap is corrupted");
+    }
+    size_t fl, sl;
+    HeapBlock::classify(b->bytes(), fl, sl);
+    if(b->next_free != (size_t) -1) {
+      heap_block(b->next_free)->previous_free = b->previous_free;
+    }
+    if(b->previous_free != (size_t) -1) {
+      heap_block(b->previous_free)->next_free = b->next_free;
+    } else if((heap_free_lists[fl][sl] = b->next_free) == (size_t) -1) {
+      heap_sl_map[fl] &= ~(1u << sl);
+      if(!heap_sl_map[fl]) {
+        heap_fl_map &= ~((uint64_t) 1 << fl);
+      }
+    }
+    return E_OK;
+  }
+
+  /** Free a block, merging it with free neighbours */
+  Error heap_release(size_t offset) {
+    HeapBlock* b = heap_block(offset);
+    if(b->size & HeapBlock::PREVIOUS_FREE) {
+      size_t previous = b->previous;
+      if(previous >= offset || !heap_block_valid(previous) || heap_block(previous)->bytes() != offset - previous) {
+        return errorf(E_INVALID_ADDRESS, "heap is corrupted");
+      }
+      WF_CHECK(heap_remove(previous));
+      heap_block(previous)->size += b->bytes();
+      offset = previous;
+      b = heap_block(offset);
+    }
+    HeapBlock* next = heap_block(offset + b->bytes());
+    if(next->size & HeapBlock::FREE) {
+      WF_CHECK(heap_remove(offset + b->bytes()));
+      b->size += next->bytes();
+      next = heap_block(offset + b->bytes());
+    }
+    b->size |= HeapBlock::FREE;
+    next->previous = offset;
+    next->size |= HeapBlock::PREVIOUS_FREE;
+    heap_insert(offset);
+    return E_OK;
+  }
+
+  /** Shrink a block in use to size bytes, freeing the rest if it's big enough to be a block */
+  Error heap_trim(size_t offset, size_t size) {
+    HeapBlock* b = heap_block(offset);
+    size_t rest = b->bytes() - size;
+    if(rest < HeapBlock::MIN) {
+      return E_OK;
+    }
+    b->size = size | (b->size & HeapBlock::FLAGS);
+    heap_block(offset + size)->size = rest;
+    return heap_release(offset + size);
+  }
+
+  /** Size of a block holding bytes of data, or 0 if it's too large */
+  size_t heap_block_size(size_t bytes) const {
+    if(bytes > heap_size) {
+      return 0;
+    }
+    size_t size = align(HeapBlock::ALIGN, bytes) + HeapBlock::HEADER;
+    return size < (size_t) HeapBlock::MIN ? (size_t) HeapBlock::MIN : size;
+  }
+
+  /** Find the offset of the block in use holding the data at addr */
+  Error heap_find(void* addr, size_t& offset) const {
+    offset = (size_t) ((char*) addr - heap) - HeapBlock::HEADER;
+    if(!heap_block_valid(offset) || (heap_block(offset)->size & HeapBlock::FREE)) {
+      return E_INVALID_ADDRESS;
+    }
+    return E_OK;
+  }
+
+  /**
+   * Allocate bytes from the heap. Unlike allot, memory isn't cleared, and can be given back with
+   * heap_free
+   */
+  template <class T>
+  Error heap_allocate(size_t bytes, T*& addr) {
+    size_t size = heap_block_size(bytes);
+    if(!size) {
+      return E_OUT_OF_MEMORY;
+    }
+
+    // Round up to the next size class, so any block on the list found is large enough
+    size_t search = size, fl, sl;
+    if(search >= HeapBlock::SMALL) {
+      search += ((size_t) 1 << (log2_floor(search) - HeapBlock::SL_LOG)) - 1;
+    }
+    HeapBlock::classify(search, fl, sl);
+    if(fl >= HeapBlock::FL_COUNT) {
+      return E_OUT_OF_MEMORY;
+    }
+    uint32_t sl_map = heap_sl_map[fl] & (~0u << sl);
+    if(!sl_map) {
+      uint64_t fl_map = heap_fl_map & (~(uint64_t) 0 << (fl + 1));
+      if(!fl_map) {
+        return E_OUT_OF_MEMORY;
+      }
+      fl = __builtin_ctzll(fl_map);
+      sl_map = heap_sl_map[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    size_t offset = heap_free_lists[fl][sl];
+    WF_CHECK(heap_remove(offset));
+    HeapBlock* b = heap_block(offset);
+    b->size &= ~(size_t) HeapBlock::FREE;
+    heap_block(offset + b->bytes())->size &= ~(size_t) HeapBlock::PREVIOUS_FREE;
+    WF_CHECK(heap_trim(offset, size));
+
+    addr = (T*) &heap[offset + HeapBlock::HEADER];
+    return E_OK;
+  }
+
+  /** Give memory from heap_allocate back to the heap */
+  Error heap_free(void* addr) {
+    size_t offset;
+    WF_CHECKF(heap_find(addr, offset), "%ld is not an address from allocate", real_to_raddr((ptrdiff_t*) addr));
+    return heap_release(offset);
+  }
+
+  /**
+   * Change the size of memory from heap_allocate, in place if possible, otherwise moving its
+   * contents. If there isn't enough memory addr is left as it was
+   */
+  template <class T>
+  Error heap_resize(T*& addr, size_t bytes) {
+    size_t offset, size = heap_block_size(bytes);
+    WF_CHECKF(heap_find(addr, offset), "%ld is not an address from allocate", real_to_raddr((ptrdiff_t*) addr));
+    if(!size) {
+      return E_OUT_OF_MEMORY;
+    }
+
+    HeapBlock* b = heap_block(offset);
+    if(size > b->bytes()) {
+      size_t next_offset = offset + b->bytes();
+      HeapBlock* next = heap_block(next_offset);
+      if((next->size & HeapBlock::FREE) && b->bytes() + next->bytes() >= size) {
+        // Grow into the free block that follows
+        WF_CHECK(heap_remove(next_offset));
+        b->size += next->bytes();
+        heap_block(offset + b->bytes())->size &= ~(size_t) HeapBlock::PREVIOUS_FREE;
+      } else {
+        char* moved;
+        WF_CHECK(heap_allocate(bytes, moved));
+        memcpy(moved, addr, b->bytes() - HeapBlock::HEADER);
+        addr = (T*) moved;
+        return heap_release(offset);
+      }
+    }
+    return heap_trim(offset, size);
+  }
+
   /** Add a forth word */
   Error create(const char* name, DictEntry*& d) {
     size_t name_length = strlen(name);
@@ -906,17 +2165,22 @@ struct State {
 
     WF_CHECK(allot(size, d));
 
-    d->previous = shared[S_LATEST].as<DictEntry>();
+    DictEntry*& bucket = index[hash_name(name) & (WF_INDEX_SIZE - 1)];
+
+    DictEntry* latest = shared[S_LATEST].as<DictEntry>();
+    d->previous = latest ? real_to_raddr((ptrdiff_t*) latest) : -1;
+    d->bucket_previous = bucket ? real_to_raddr((ptrdiff_t*) bucket) : -1;
     d->name.length = name_length;
     strncpy(d->name.bytes, name, name_length);
 
     WF_LOG(WF_RT, "create word " << name);
 
-    WF_ASSERT(d->previous == shared[S_LATEST].as<DictEntry>());
+    WF_ASSERT(dict_follow(d->previous) == latest);
     WF_ASSERT(d->name.length == name_length);
     WF_ASSERT(strcmp(d->name.bytes, name) == 0);
 
     shared[S_LATEST].set(d);
+    bucket = d;
 
     return E_OK;
   }
@@ -947,11 +2211,17 @@ struct State {
     return E_OK;
   }
 
+  /**
+   * Add a C++ backed Forth word which the compiler replaces with a native opcode. The C++
+   * function is still used when the word is interpreted or executed immediately.
+   */
+  Error defop(Opcode op, const char* name, c_word_t fnaddr, ptrdiff_t flags = 0) {
+    WF_CHECK(defw(name, fnaddr, flags + DictEntry::FLAG_OPCODE));
+    return dict_put(op);
+  }
+
   Error require_cells(size_t cells) {
-    if((memory_i + (sizeof(Cell) * cells)) > memory_size) {
-      return E_OUT_OF_MEMORY;
-    }
-    return E_OK;
+    return memory_reserve(memory_i + (sizeof(Cell) * cells));
   }
 
   /** Push a cell into memory, comma in Forth */
@@ -982,17 +2252,16 @@ struct State {
   }
 
   /**
-   * Lookup a word in the dictionary
+   * Lookup a word in the dictionary. Finds the latest visible definition of a name
    */
   DictEntry* lookup(const char* name) const {
-    DictEntry* e = shared[S_LATEST].as<DictEntry>();
+    DictEntry* e = index[hash_name(name) & (WF_INDEX_SIZE - 1)];
 
     while(e) {
-      // TODO: Skip HIDDEN
-      if(strcmp(e->name.bytes, name) == 0) {
+      if((e->flags & DictEntry::FLAG_HIDDEN) == 0 && strcmp(e->name.bytes, name) == 0) {
         return e;
       }
-      e = e->previous;
+      e = dict_follow(e->bucket_previous);
     }
 
     return 0;
@@ -1000,16 +2269,65 @@ struct State {
 
   /***** MAIN INTERPRETER */
 
+  /**
+   * Reads up to size bytes of source into buffer, returning the number of bytes read, 0 at the end
+   * of input or -1 on error
+   */
+  typedef ptrdiff_t (*input_read_t)(void* ctx, char* buffer, size_t size);
+
+  /** Source being tokenized. For streams, a buffer refilled by input_read */
   const char* input;
   size_t input_i;
   size_t input_size;
+  input_read_t input_read;
+  void* input_ctx;
+  bool input_error;
   ptrdiff_t token_number;
 
+  // Convenience struct to restore the input of an outer exec, e.g. when include calls exec
+  struct InputSave {
+    InputSave(State& state_): state(state_), input(state.input), input_i(state.input_i),
+      input_size(state.input_size), input_read(state.input_read), input_ctx(state.input_ctx),
+      input_error(state.input_error) {}
+    ~InputSave() {
+      state.input = input;
+      state.input_i = input_i;
+      state.input_size = input_size;
+      state.input_read = input_read;
+      state.input_ctx = input_ctx;
+      state.input_error = input_error;
+    }
+
+    State& state;
+    const char* input;
+    size_t input_i, input_size;
+    input_read_t input_read;
+    void* input_ctx;
+    bool input_error;
+  };
+
+  /** Check for more input, refilling the buffer from a stream when it runs out */
+  bool input_available() {
+    if(input_i < input_size) {
+      return true;
+    }
+    if(!input_read) {
+      return false;
+    }
+    ptrdiff_t n = input_read(input_ctx, (char*) input, WF_INPUT_CHUNK_SIZE);
+    input_i = 0;
+    input_size = n > 0 ? n : 0;
+    if(n < 0) {
+      input_error = true;
+    }
+    return input_size != 0;
+  }
+
   Error next_token(Token& tk) {
     char c;
-    while(input_i < input_size) {
+    while(input_available()) {
       char c = input[input_i++];
-      if((c == '-' && input_i < input_size && isdigit(input[input_i])) || isdigit(c)) {
+      if((c == '-' && input_available() && isdigit(input[input_i])) || isdigit(c)) {
         // Number
         bool negative = false;
         if(c == '-') {
@@ -1017,7 +2335,7 @@ struct State {
           negative = true;
         }
         ptrdiff_t n = c - '0';
-        while(input_i < input_size) {
+        while(input_available()) {
           c = input[input_i++];
           if(isdigit(c)) {
             n *= 10;
@@ -1035,7 +2353,7 @@ struct State {
         continue;
       } else if(c == '\\') {
         // swallow comments
-        while(input_i < input_size) {
+        while(input_available()) {
           c = input[input_i++];
           if(c == '\n') {
             break;
@@ -1043,7 +2361,7 @@ struct State {
         }
       } else if(c == '"') {
         scratch_i = 0;
-        while(input_i < input_size) {
+        while(input_available()) {
           c = input[input_i++];
           if(c == '"') {
             break;
@@ -1057,7 +2375,7 @@ struct State {
         // Word
         scratch_i = 1;
         scratch[0] = c;
-        while(input_i < input_size) {
+        while(input_available()) {
           c = input[input_i++];
           if(isspace(c)) { 
             break;
@@ -1069,29 +2387,149 @@ struct State {
         return E_OK;
       }
     }
+    if(input_error) {
+      return errorf(E_IO, "failed to read input");
+    }
     tk = TK_END;
     return E_OK;
   }
 
+  /** Emit code that calls a word */
+  Error compile_call(DictEntry* word) {
+    if(word->flags & DictEntry::FLAG_ASYNC) {
+      compile_async = true;
+    }
+    if(word->flags & DictEntry::FLAG_OPCODE) {
+      // Builtin with a native implementation, emit its opcode directly
+      return dict_put(word->data<ptrdiff_t>()[1]);
+    } else if(word->flags & DictEntry::FLAG_CWORD) {
+      // Push c call followed by function pointer
+      WF_CHECK(dict_put(OP_CALL_C));
+      return dict_put(*word->data<ptrdiff_t>());
+    }
+    // Push forth call followed by pointer to forth VM code
+    last_call_i = memory_i;
+    WF_CHECK(dict_put(OP_CALL_FORTH));
+    return dict_put(real_to_raddr(word->data<ptrdiff_t>()));
+  }
+
+  /**
+   * Copy the string in scratch into memory, then either push its address or emit code that pushes
+   * it
+   */
+  Error put_string(bool compiling) {
+    ptrdiff_t* jmpaddr = 0;
+
+    // If compiling, we need to jump past the actual string object in the body of the word
+    if(compiling) {
+      WF_CHECK(dict_put(OP_JUMP_IGNORED));
+      jmpaddr = (ptrdiff_t*) &memory[memory_i];
+      WF_CHECK(dict_put(-1));
+    }
+
+    // If interpreting, push string addr
+    String* str;
+    WF_CHECK(allot(align(sizeof(ptrdiff_t), sizeof(String) + scratch_i + 1), str));
+    str->length = scratch_i - 1;
+    memcpy(str->bytes, scratch, scratch_i);
+
+    // If compiling, emit string addr
+    if(compiling) {
+      (*jmpaddr) = real_to_raddr((ptrdiff_t*) &memory[memory_i]);
+      WF_CHECK(dict_put(OP_PUSH_IMMEDIATE));
+      return dict_put((real_to_raddr((ptrdiff_t*) str)));
+    }
+    return push(real_to_raddr((ptrdiff_t*) str));
+  }
+
   /** 
    * Execute arbitrary code
    */
   Error exec(const char* input_) {
+    InputSave is(*this);
     input = input_;
     input_size = strlen(input_);
     input_i = 0;
+    input_read = 0;
+    input_error = false;
+    Error e = interpret();
+#if WF_JIT
+    // Leave what was compiled ready to run, e.g. from States layered on this one
+    jit_seal();
+#endif
+    return e;
+  }
+
+  /**
+   * Execute source read a chunk at a time, so that memory use doesn't depend on the length of the
+   * source
+   */
+  Error exec(input_read_t read, void* ctx) {
+    InputSave is(*this);
+    char buffer[WF_INPUT_CHUNK_SIZE];
+    input = buffer;
+    input_size = 0;
+    input_i = 0;
+    input_read = read;
+    input_ctx = ctx;
+    input_error = false;
+    Error e = interpret();
+#if WF_JIT
+    // Leave what was compiled ready to run, e.g. from States layered on this one
+    jit_seal();
+#endif
+    return e;
+  }
+
+  /** Execute source from a file */
+  Error exec(FILE* file) {
+    return exec([](void* ctx, char* buffer, size_t size) {
+      size_t n = fread(buffer, 1, size, (FILE*) ctx);
+      return n == 0 && ferror((FILE*) ctx) ? -1 : (ptrdiff_t) n;
+    }, file);
+  }
+
+  /** Execute source from a file descriptor */
+  Error exec_fd(int fd) {
+    return exec([](void* ctx, char* buffer, size_t size) {
+      return (ptrdiff_t) read((int) (ptrdiff_t) ctx, buffer, size);
+    }, (void*) (ptrdiff_t) fd);
+  }
+
+  /** Execute source from a std::istream, or anything else with read and gcount */
+  template <class IStream>
+  Error exec_istream(IStream& in) {
+    return exec([](void* ctx, char* buffer, size_t size) {
+      IStream& in = *(IStream*) ctx;
+      in.read(buffer, size);
+      return in.bad() ? -1 : (ptrdiff_t) in.gcount();
+    }, &in);
+  }
+
+  /** Execute a Forth source file */
+  Error include(const char* path) {
+    FILE* file = fopen(path, "r");
+    if(!file) {
+      return errorf(E_IO, "could not open %s", path);
+    }
+    Error e = exec(file);
+    fclose(file);
+    return e;
+  }
 
+  /** Interpret everything remaining in the input */
+  Error interpret() {
     Token tk;
     WF_CHECK(next_token(tk));
     while(tk != TK_END) {
       if(tk == TK_NUMBER) {
         // If interpreting, push directly
         if(*shared[S_COMPILING] == 0) {
-          push(token_number);
+          WF_CHECK(push(token_number));
         } else {
           // If compiling, push opcode
-          dict_put(OP_PUSH_IMMEDIATE);
-          dict_put(token_number);
+          WF_CHECK(dict_put(OP_PUSH_IMMEDIATE));
+          WF_CHECK(dict_put(token_number));
         }
       } else if(tk == TK_WORD) {
         // We now have a word, look it up in the dictionary
@@ -1104,15 +2542,7 @@ struct State {
 
           // If in compilation and this is not an immediate word
           if(*shared[S_COMPILING] && (word->flags & DictEntry::FLAG_IMMEDIATE) == 0) {
-            if(word->flags & DictEntry::FLAG_CWORD) {
-              // Push c call followed by function pointer
-              WF_CHECK(dict_put(OP_CALL_C));
-              WF_CHECK(dict_put(*word->data<ptrdiff_t>()));
-            } else {
-              // Push forth call followed by pointer to forth VM code
-              WF_CHECK(dict_put(OP_CALL_FORTH));
-              WF_CHECK(dict_put(real_to_raddr(word->data<ptrdiff_t>())));
-            }
+            WF_CHECK(compile_call(word));
           } else {
             // Either interpreting or this is an immediate word
             if(word->flags & DictEntry::FLAG_CWORD) {
@@ -1144,29 +2574,7 @@ struct State {
           return errorf_append(E_WORD_NOT_FOUND, "could not find word during interpretation");
         }
       } else if(tk == TK_STRING) {
-        ptrdiff_t* jmpaddr = 0;
-
-        // If compiling, we need to jump past the actual string object in the body of the word
-        if(*shared[S_COMPILING] != 0) {
-          WF_CHECK(dict_put(OP_JUMP_IGNORED));
-          jmpaddr = (ptrdiff_t*) &memory[memory_i];
-          WF_CHECK(dict_put(-1));
-        }
-
-        // If interpreting, push string addr
-        String* str;
-        WF_CHECK(allot(align(sizeof(ptrdiff_t), sizeof(String) + scratch_i + 1), str));
-        str->length = scratch_i - 1;
-        memcpy(str->bytes, scratch, scratch_i);
-
-        // If compiling, emit string addr
-        if(*shared[S_COMPILING] != 0) {
-          (*jmpaddr) = real_to_raddr((ptrdiff_t*) &memory[memory_i]);
-          WF_CHECK(dict_put(OP_PUSH_IMMEDIATE));
-          WF_CHECK(dict_put((real_to_raddr((ptrdiff_t*) str))));
-        } else {
-          WF_CHECK(push(real_to_raddr((ptrdiff_t*) str)));
-        }
+        WF_CHECK(put_string(*shared[S_COMPILING] != 0));
       }
       WF_CHECK(next_token(tk));
     }
@@ -1174,89 +2582,1879 @@ struct State {
     return E_OK;
   }
 
-  /***** VIRTUAL MACHINE */
-
-  // Convenience struct to restore to last locals after exiting function
-  struct LocalsSave {
-    LocalsSave(State& state_): state(state_), locals_i(state.locals.i) {}
-    ~LocalsSave() {
-      if(state.locals.i != locals_i) {
+  /**
+   * Compile source once into an anonymous block of code in the dictionary, which can then be run
+   * any number of times by passing it to exec(ptrdiff_t*) without tokenizing again.
+   *
+   * Only a subset of what exec(const char*) accepts can be compiled: source that stays in
+   * interpretation state. Every word, including immediate ones, is called when the block runs
+   * rather than during compile(), so immediate words see the stack of the run. Words that read the
+   * next word of input, such as : variable and ', are rejected with E_WANT_WORD.
+   */
+  Error compile(const char* input_, ptrdiff_t*& code) {
+    size_t start = memory_i;
+    Error e = compile_block(input_);
+    if(e != E_OK) {
+      memory_i = start;
+      return e;
+    }
+    code = (ptrdiff_t*) start;
+#if WF_VERIFY
+    verify(start, memory_i);
+#endif
+    return E_OK;
+  }
+
+  Error compile_block(const char* input_) {
+    InputSave is(*this);
+    input = input_;
+    input_size = strlen(input_);
+    input_i = 0;
+    input_read = 0;
+    input_error = false;
+
+    Token tk;
+    WF_CHECK(next_token(tk));
+    while(tk != TK_END) {
+      if(tk == TK_NUMBER) {
+        WF_CHECK(dict_put(OP_PUSH_IMMEDIATE));
+        WF_CHECK(dict_put(token_number));
+      } else if(tk == TK_WORD) {
+        DictEntry* word = lookup(scratch);
+        if(!word) {
+          return errorf(E_WORD_NOT_FOUND, "could not find word %s during compilation", scratch);
+        }
+        if(word->flags & DictEntry::FLAG_COMPILE_ONLY) {
+          return E_COMPILE_ONLY;
+        }
+        if(word->flags & DictEntry::FLAG_READS_INPUT) {
+          return errorf(E_WANT_WORD, "word %s reads input and can't be compiled", scratch);
+        }
+        WF_CHECK(compile_call(word));
+      } else if(tk == TK_STRING) {
+        WF_CHECK(put_string(true));
+      }
+      WF_CHECK(next_token(tk));
+    }
+
+    return dict_put(OP_EXIT);
+  }
+
+  /***** IMAGES */
+
+  // An image is an ImageHeader, then the name of the dictionary entry for each cword (a uint32_t
+  // length followed by its bytes), then memory[0..memory_i] and shared. Addresses in memory are
+  // already relative, so loading an image is mostly a copy. cwords are bound by name to the C++
+  // functions of the State loading it
+
+  struct ImageHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t cell_size;
+    uint32_t cwords;
+    uint64_t memory_i;
+    uint64_t shared_size;
+    /** Relative address of S_LATEST, or -1 if the dictionary is empty */
+    int64_t latest;
+  };
+
+  enum { IMAGE_VERSION = 2 };
+
+  /** Find the dictionary entry of a cword */
+  DictEntry* cword_entry(size_t slot) const {
+    for(DictEntry* d = shared[S_LATEST].as<DictEntry>(); d; d = dict_follow(d->previous)) {
+      if((d->flags & DictEntry::FLAG_CWORD) && (size_t) ((*d->data<ptrdiff_t>() + 1) / 2) == slot) {
+        return d;
+      }
+    }
+    return 0;
+  }
+
+  /**
+   * Rebuild the lookup index from the dictionary. Bucket chains are relinked too, since they
+   * depend on WF_INDEX_SIZE, which an image may have been saved with a different value of
+   */
+  void index_rebuild() {
+    // Walking back from the latest entry chains each bucket from its oldest entry forwards...
+    memset(index, 0, sizeof(index));
+    for(DictEntry* d = shared[S_LATEST].as<DictEntry>(); d && !in_base(d); d = dict_follow(d->previous)) {
+      DictEntry*& bucket = index[hash_name(d->name.bytes) & (WF_INDEX_SIZE - 1)];
+      d->bucket_previous = bucket ? real_to_raddr((ptrdiff_t*) bucket) : -1;
+      bucket = d;
+    }
+    // ...so reverse each chain, ending it at the base's entries in the bucket
+    for(size_t i = 0; i != WF_INDEX_SIZE; i++) {
+      DictEntry* older = base ? base->index[i] : 0;
+      for(DictEntry* d = index[i]; d;) {
+        DictEntry* newer = dict_follow(d->bucket_previous);
+        d->bucket_previous = older ? real_to_raddr((ptrdiff_t*) older) : -1;
+        older = d;
+        d = newer;
+      }
+      index[i] = older;
+    }
+  }
+
+  /** Save the dictionary and shared variables as an image. The heap isn't saved */
+  Error save_image(FILE* out) {
+    WF_CHECKF(*shared[S_COMPILING] == 0 ? E_OK : E_COMPILE_ONLY, "can't save an image while compiling");
+
+    DictEntry* latest = shared[S_LATEST].as<DictEntry>();
+    ImageHeader header;
+    memcpy(header.magic, "WOOF", 4);
+    header.version = IMAGE_VERSION;
+    header.cell_size = sizeof(Cell);
+    header.cwords = cwords.i;
+    header.memory_i = memory_i;
+    header.shared_size = shared_size;
+    header.latest = latest ? (int64_t) real_to_raddr((ptrdiff_t*) latest) : -1;
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for(size_t i = 0; ok && i != cwords.i; i++) {
+      DictEntry* d = cword_entry(i);
+      uint32_t length = d ? d->name.length : 0;
+      ok = fwrite(&length, sizeof(length), 1, out) == 1 && fwrite(d ? d->name.bytes : "", 1, length, out) == length;
+    }
+
+    // A layered State is saved as a whole, base dictionary included
+    if(base) {
+      ok = ok && image_write_memory(out, *base, 0, base_i);
+    }
+    ok = ok && image_write_memory(out, *this, base_i, memory_i);
+
+    // S_LATEST is the only absolute address in shared
+    Cell latest_cell = shared[S_LATEST];
+    shared[S_LATEST] = header.latest;
+    ok = ok && fwrite(shared, sizeof(Cell), shared_size, out) == shared_size;
+    shared[S_LATEST] = latest_cell;
+
+    return ok ? E_OK : errorf(E_IO, "failed to write image");
+  }
+
+  /**
+   * Write memory [from, to) of owner to an image, with the bytecode of words compiled by its JIT
+   * rather than OP_NATIVE
+   */
+  static bool image_write_memory(FILE* out, const State& owner, size_t from, size_t to) {
+    size_t i = from;
+#if WF_JIT
+    // Words are compiled as they are defined, so the table is in order of address
+    for(size_t w = 0; w != owner.jit_words_i; w++) {
+      const JitWord& jw = owner.jit_words()[w];
+      size_t code = jw.code;
+      if(code < from || code >= to) {
+        continue;
+      }
+      if(fwrite(&owner.memory[i], 1, code - i, out) != code - i || fwrite(jw.saved, sizeof(ptrdiff_t), 2, out) != 2) {
+        return false;
+      }
+      i = code + 2 * sizeof(ptrdiff_t);
+    }
+#endif
+    return fwrite(&owner.memory[i], 1, to - i, out) == to - i;
+  }
+
+  /**
+   * Replace the dictionary and shared variables with an image. C++ words it uses must already be
+   * defined in this State, under the same names
+   */
+  Error load_image(input_read_t read, void* ctx) {
+    WF_CHECKF(*shared[S_COMPILING] == 0 ? E_OK : E_COMPILE_ONLY, "can't load an image while compiling");
+    WF_CHECKF(base ? E_INVALID_ADDRESS : E_OK, "can't load an image over a base dictionary");
+
+    ImageHeader header;
+    WF_CHECK(read_exactly(read, ctx, (char*) &header, sizeof(header)));
+    if(memcmp(header.magic, "WOOF", 4) != 0 || header.version != IMAGE_VERSION || header.cell_size != sizeof(Cell)) {
+      return errorf(E_IO, "not a compatible image");
+    }
+    if(header.cwords > cwords.size || header.shared_size > shared_size) {
+      return errorf(E_OUT_OF_MEMORY, "image has more cwords or shared variables than this state");
+    }
+
+    // Bind cwords to functions in a table at the end of memory, which must not overlap either this
+    // dictionary, still needed to look them up, or the image's
+    size_t table_size = align(sizeof(Cell), header.cwords * sizeof(c_word_t));
+    size_t table_i = memory_size - table_size;
+    if(header.memory_i + table_size > memory_size && memory_reserve(header.memory_i + table_size) == E_OK) {
+      table_i = memory_size - table_size;
+    }
+    if(header.memory_i > table_i || memory_i > table_i) {
+      return errorf(E_OUT_OF_MEMORY, "image does not fit in memory");
+    }
+    c_word_t* table = (c_word_t*) &memory[table_i];
+    for(size_t i = 0; i != header.cwords; i++) {
+      uint32_t length;
+      WF_CHECK(read_exactly(read, ctx, (char*) &length, sizeof(length)));
+      if(length >= WF_SCRATCH_SIZE) {
+        return errorf(E_OUT_OF_SCRATCH, "cword name in image is too long");
+      }
+      WF_CHECK(read_exactly(read, ctx, scratch, length));
+      scratch[length] = '\0';
+      table[i] = 0;
+      if(length == 0) {
+        continue;
+      }
+      DictEntry* d = lookup(scratch);
+      if(!d || (d->flags & DictEntry::FLAG_CWORD) == 0) {
+        return errorf(E_WORD_NOT_FOUND, "image uses C++ word %s which is not defined", scratch);
+      }
+      WF_CHECK(cword_get(*d->data<ptrdiff_t>(), table[i]));
+    }
+
+#if WF_JIT
+    // Machine code refers to the old dictionary
+    jit_words_i = 0;
+#endif
+#if WF_VERIFY
+    verify_clear();
+#endif
+
+    Error e = read_exactly(read, ctx, memory, header.memory_i);
+    if(e == E_OK) {
+      e = read_exactly(read, ctx, (char*) shared, header.shared_size * sizeof(Cell));
+    }
+    if(e != E_OK) {
+      // The old dictionary is gone, leave an empty one rather than a partial image
+      memset(memory, 0, memory_size);
+      memory_i = 0;
+      for(size_t i = 0; i != shared_size; i++) {
+        shared[i] = Cell();
+      }
+      cwords.i = 0;
+      memset(index, 0, sizeof(index));
+      return e;
+    }
+
+    for(size_t i = 0; i != header.cwords; i++) {
+      cwords.data[i] = (ptrdiff_t) table[i];
+    }
+    cwords.i = header.cwords;
+    memory_i = header.memory_i;
+    memset(&memory[memory_i], 0, memory_size - memory_i);
+    shared[S_LATEST].set(header.latest == -1 ? 0 : raddr_to_real((ptrdiff_t*) header.latest));
+    index_rebuild();
+#if WF_VERIFY
+    verify_all();
+#endif
+    return E_OK;
+  }
+
+  Error load_image(FILE* in) {
+    return load_image([](void* ctx, char* buffer, size_t size) {
+      size_t n = fread(buffer, 1, size, (FILE*) ctx);
+      return n == 0 && ferror((FILE*) ctx) ? -1 : (ptrdiff_t) n;
+    }, in);
+  }
+
+  /** Load an image from memory, e.g. a file mapped with mmap */
+  Error load_image(const char* image, size_t size) {
+    struct Source { const char* data; size_t size; } src = {image, size};
+    return load_image([](void* ctx, char* buffer, size_t size) {
+      Source* src = (Source*) ctx;
+      size_t n = size < src->size ? size : src->size;
+      memcpy(buffer, src->data, n);
+      src->data += n;
+      src->size -= n;
+      return (ptrdiff_t) n;
+    }, &src);
+  }
+
+  /** Read exactly size bytes, e.g. for loading an image */
+  Error read_exactly(input_read_t read, void* ctx, char* buffer, size_t size) {
+    while(size) {
+      ptrdiff_t n = read(ctx, buffer, size);
+      if(n <= 0) {
+        return errorf(E_IO, n == 0 ? "unexpected end of image" : "failed to read image");
+      }
+      buffer += n;
+      size -= n;
+    }
+    return E_OK;
+  }
+
+  /***** CHECKPOINTS */
+
+  /** A point in the dictionary's history that State::restore can roll back to */
+  struct Checkpoint {
+    size_t memory_i;
+    /** Relative address of S_LATEST, or -1 if the dictionary is empty */
+    ptrdiff_t latest;
+    size_t cwords_i;
+  };
+
+  /** Save where the dictionary is now */
+  Checkpoint checkpoint() const {
+    DictEntry* latest = shared[S_LATEST].as<DictEntry>();
+    return Checkpoint{memory_i, latest ? real_to_raddr((ptrdiff_t*) latest) : -1, cwords.i};
+  }
+
+  /** The checkpoint just before an entry was created, for forget */
+  Error checkpoint_before(DictEntry* d, Checkpoint& cp) {
+    WF_CHECKF(in_base(d) ? E_INVALID_ADDRESS : E_OK, "can't forget a word in the base dictionary");
+    cp.memory_i = real_to_raddr((ptrdiff_t*) d);
+    cp.latest = d->previous;
+    // C words registered since are all in entries after this one
+    cp.cwords_i = cwords.i;
+    for(DictEntry* e = shared[S_LATEST].as<DictEntry>(); e; e = e == d ? 0 : dict_follow(e->previous)) {
+      if(e->flags & DictEntry::FLAG_CWORD) {
+        cp.cwords_i = (*e->data<ptrdiff_t>() + 1) / 2;
+      }
+    }
+    return E_OK;
+  }
+
+  /**
+   * Forget everything defined since a checkpoint, reclaiming its memory, C++ words and machine
+   * code, and abandon any definition in progress or suspended code. This costs about as much as
+   * what it forgets, so a host can cheaply reset a State with libraries loaded between requests.
+   * Checkpoints taken after cp can't be restored afterwards. The heap and profile are left alone
+   */
+  Error restore(const Checkpoint& cp) {
+    bool valid = cp.memory_i >= base_i && cp.memory_i <= memory_i && cp.cwords_i <= cwords.i &&
+      cp.latest >= -1 && cp.latest < (ptrdiff_t) cp.memory_i;
+    WF_CHECKF(valid ? E_OK : E_INVALID_ADDRESS, "checkpoint at %ld is not in the dictionary", cp.memory_i);
+    if(suspended.code) {
+      cancel();
+    }
+    shared[S_COMPILING] = 0;
+    shared[S_WORD_AVAILABLE] = 0;
+    shared[S_LOCAL_COUNT] = 0;
+
+    memory_i = cp.memory_i;
+    memset(&memory[memory_i], 0, sizeof(Cell));
+    shared[S_LATEST].set(dict_follow(cp.latest));
+    cwords.i = cp.cwords_i;
+    if(last_call_i >= memory_i) {
+      last_call_i = 0;
+    }
+#if WF_VERIFY
+    verify_truncate();
+#endif
+
+    // Entries in each bucket are chained newest first, so drop forgotten ones from the front
+    for(size_t i = 0; i != WF_INDEX_SIZE; i++) {
+      while(index[i] && !in_base(index[i]) && real_to_raddr((ptrdiff_t*) index[i]) >= (ptrdiff_t) memory_i) {
+        index[i] = dict_follow(index[i]->bucket_previous);
+      }
+    }
+
+#if WF_JIT
+    // Words are compiled as they are defined, so forgotten ones are at the end
+    while(jit_words_i && jit_words()[jit_words_i - 1].code >= (ptrdiff_t) memory_i) {
+      jit_i = jit_words()[--jit_words_i].start;
+    }
+#endif
+    return E_OK;
+  }
+
+  /***** CLONING */
+
+  /**
+   * Copy this State into the memory of another config, so that State(cfg) starts out with the same
+   * dictionary, shared variables, C++ words and data stack. Only the used parts are copied and
+   * nothing is interpreted, so this is much cheaper than building a State up from source.
+   * Changes to either State after cloning are not seen by the other. The clone starts with an empty
+   * heap of its own, from cfg
+   */
+  Error clone_into(StateConfig& cfg) {
+    // A layered State only copies its own memory, and the clone shares its base
+    size_t own = memory_i - base_i;
+    if(cfg.memory_size < own + sizeof(Cell) && cfg.memory_grow) {
+      size_t grown = cfg.memory_grow(cfg.memory_grow_ctx, own + sizeof(Cell));
+      cfg.memory_size = grown > cfg.memory_size ? grown : cfg.memory_size;
+    }
+    if(cfg.memory_size < own || cfg.stack_size < si || cfg.shared_size < shared_size || cfg.cwords.size < cwords.i) {
+      return errorf(E_OUT_OF_MEMORY, "config is too small to clone into");
+    }
+
+    memcpy(cfg.memory, &memory[base_i], own);
+    // Memory past memory_i may hold whatever a previous user of the config left there. allot
+    // clears memory as it hands it out, only the cell at memory_i can be read before then
+    memset(&cfg.memory[own], 0, cfg.memory_size - own < sizeof(Cell) ? cfg.memory_size - own : sizeof(Cell));
+    memcpy(cfg.stack, stack, si * sizeof(Cell));
+    memcpy(cfg.shared, shared, shared_size * sizeof(Cell));
+    for(size_t i = shared_size; i < cfg.shared_size; i++) {
+      cfg.shared[i] = Cell();
+    }
+    memcpy(cfg.cwords.data, cwords.data, cwords.i * sizeof(ptrdiff_t));
+    cfg.cwords.i = cwords.i;
+    cfg.locals.i = 0;
+    cfg.base = base;
+
+    // S_LATEST is the only absolute address, dictionary links are relative
+    DictEntry* latest = shared[S_LATEST].as<DictEntry>();
+    if(latest && !in_base(latest)) {
+      cfg.shared[S_LATEST].set((DictEntry*) &cfg.memory[real_to_raddr((ptrdiff_t*) latest) - base_i]);
+    }
+
+#if WF_JIT
+    // The clone has no machine code of its own, so it runs the bytecode of compiled words. Words in
+    // the base stay compiled, since they belong to the base
+    for(size_t i = 0; i != jit_words_i; i++) {
+      ptrdiff_t* code = (ptrdiff_t*) &cfg.memory[jit_words()[i].code - base_i];
+      code[0] = jit_words()[i].saved[0];
+      code[1] = jit_words()[i].saved[1];
+    }
+#endif
+
+    // memory_i is never 0 for a State, since builtins are always defined
+    cfg.memory_i = memory_i;
+    cfg.si = si;
+    return E_OK;
+  }
+
+  /***** OPTIMIZER */
+
+  /**
+   * Make work hold at least n uint32_ts and return it, or 0 if it can't be mapped. Passes over a
+   * word's code keep their per-cell tables here rather than past the end of the dictionary
+   */
+  uint32_t* work_reserve(size_t n) {
+    if(n > work_size) {
+      size_t size = n < work_size * 2 ? work_size * 2 : align(1024, n);
+      void* m = mmap(0, size * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(m == MAP_FAILED) {
+        return 0;
+      }
+      if(work) {
+        munmap(work, work_size * sizeof(uint32_t));
+      }
+      work = (uint32_t*) m;
+      work_size = size;
+    }
+    return work;
+  }
+
+  /** The cell of the code at start_i that a jump operand lands on, if it is one of its cells */
+  static bool optimize_target(size_t start_i, size_t cells, ptrdiff_t operand, size_t& target) {
+    if(operand < (ptrdiff_t) start_i || (operand - start_i) % sizeof(Cell)) {
+      return false;
+    }
+    target = (operand - start_i) / sizeof(Cell);
+    return target < cells;
+  }
+
+  /** Work out op applied to a (second) and b (top) as the VM would, if it wouldn't fail */
+  static bool optimize_fold(ptrdiff_t op, ptrdiff_t a, ptrdiff_t b, ptrdiff_t& result) {
+    switch(op) {
+      // Wrapping, like the machine the VM runs on does
+      case OP_ADD: result = (ptrdiff_t) ((size_t) a + (size_t) b); return true;
+      case OP_SUB: result = (ptrdiff_t) ((size_t) a - (size_t) b); return true;
+      case OP_MUL: result = (ptrdiff_t) ((size_t) a * (size_t) b); return true;
+      case OP_GT: result = a > b ? -1 : 0; return true;
+      case OP_EQ: result = a == b; return true;
+      case OP_MOD: result = b == -1 ? 0 : b ? a % b : 0; return b != 0;
+      default: return false;
+    }
+  }
+
+  /**
+   * Optimize the code of the word ; just finished, from start_i to memory_i, ending with OP_EXIT.
+   * Jumps to jumps are sent straight to the end of the chain. Then the code after the last data in
+   * the word, such as a string or a local's dictionary entry, is rewritten and packed down:
+   * arithmetic on constants is worked out, a constant condition becomes a jump or nothing, a
+   * constant that is dropped goes, code after a jump or exit that nothing jumps to goes, as do
+   * jumps to the next instruction, and reading a local just after setting it becomes a dup before
+   * setting it. Code it doesn't understand is left alone
+   */
+  void optimize(size_t start_i) {
+    size_t end_i = memory_i, cells = (end_i - start_i) / sizeof(Cell);
+    uint32_t* kind = cells ? work_reserve(cells * 3) : 0;
+    if(!kind) {
+      return;
+    }
+
+    // Scratch space holds, for each cell, whether an instruction starts there and whether anything
+    // jumps to it, then where the instruction ends up, then where the instructions written since
+    // the last jump target start
+    const uint32_t DATA = 0, INSN = 1, TARGET = 2;
+    uint32_t* moved = &kind[cells];
+    uint32_t* written = &moved[cells];
+    memset(kind, 0, cells * sizeof(uint32_t));
+    ptrdiff_t* code = (ptrdiff_t*) &memory[start_i];
+
+    // Find the instructions, following jumps over data to where the code carries on
+    size_t tail = 0, target;
+    for(size_t c = 0; c != cells;) {
+      ptrdiff_t op = code[c];
+      if(op <= OP_UNKNOWN || op >= OP_NATIVE || (opcode_has_operand(op) && c + 1 == cells)) {
+        return;
+      }
+      kind[c] = INSN;
+      c += opcode_has_operand(op) ? 2 : 1;
+      if(op == OP_JUMP_IGNORED) {
+        if(!optimize_target(start_i, cells, code[c - 1], target) || target < c) {
+          return;
+        }
+        tail = c = target;
+      }
+    }
+
+    for(size_t c = 0; c != cells; c++) {
+      ptrdiff_t op = code[c];
+      if(kind[c] == DATA || !opcode_has_operand(op)) {
+        continue;
+      }
+      if(op == OP_JUMP || op == OP_JUMP_IF_ZERO || op == OP_JUMP_IGNORED) {
+        // Jumps out of the word are left for the verifier to turn down
+        if(!optimize_target(start_i, cells, code[c+1], target)) {
+          continue;
+        }
+        if(kind[target] == DATA) {
+          return;
+        }
+        for(size_t hops = 0; hops != 16 && (code[target] == OP_JUMP || code[target] == OP_JUMP_IGNORED); hops++) {
+          size_t next;
+          if(!optimize_target(start_i, cells, code[target+1], next) || kind[next] == DATA) {
+            break;
+          }
+          target = next;
+        }
+        code[c+1] = start_i + target * sizeof(Cell);
+      } else if(op != OP_CALL_C && op != OP_LOCAL_PUSH && code[c+1] > (ptrdiff_t) (start_i + tail * sizeof(Cell)) &&
+          code[c+1] < (ptrdiff_t) end_i) {
+        // Something refers to code that would move, e.g. data compiled with ,
+        return;
+      }
+    }
+    for(size_t c = 0; c != cells; c++) {
+      if(kind[c] != DATA && (code[c] == OP_JUMP || code[c] == OP_JUMP_IF_ZERO || code[c] == OP_JUMP_IGNORED) &&
+          optimize_target(start_i, cells, code[c+1], target)) {
+        kind[target] |= TARGET;
+      }
+    }
+
+    // Rewrite the code from tail, which only moves it down. Instructions are only combined with
+    // ones written since the last jump target, so code jumped to does the same as before
+    size_t w = tail, n = 0;
+    bool dead = false;
+    for(size_t r = tail; r != cells;) {
+      ptrdiff_t op = code[r], operand = opcode_has_operand(op) ? code[r+1] : 0;
+      // A jump to here, with nothing left in between
+      if(n && code[written[n-1]] == OP_JUMP && code[written[n-1] + 1] == (ptrdiff_t) (start_i + r * sizeof(Cell))) {
+        w = written[--n];
+      }
+      if(kind[r] & TARGET) {
+        dead = false;
+        n = 0;
+      }
+      moved[r] = w;
+      r += opcode_has_operand(op) ? 2 : 1;
+      // The final exit stays, since decompile and the JIT look for the end of a word
+      if(dead && r != cells) {
+        continue;
+      }
+      ptrdiff_t* last = n ? &code[written[n-1]] : 0;
+      ptrdiff_t* second = n > 1 ? &code[written[n-2]] : 0;
+      ptrdiff_t folded;
+      if(second && last[0] == OP_PUSH_IMMEDIATE && second[0] == OP_PUSH_IMMEDIATE &&
+          optimize_fold(op, second[1], last[1], folded)) {
+        second[1] = folded;
+        w = written[--n];
+        continue;
+      }
+      if(last && last[0] == OP_PUSH_IMMEDIATE && (op == OP_DROP || op == OP_JUMP_IF_ZERO)) {
+        bool jump = op == OP_JUMP_IF_ZERO && last[1] == 0;
+        w = written[--n];
+        if(!jump) {
+          continue;
+        }
+        op = OP_JUMP;
+      }
+      if(last && last[0] == OP_LOCAL_SET && op == OP_LOCAL_PUSH && operand == 0) {
+        last[0] = OP_DUP;
+        op = OP_LOCAL_SET;
+      }
+      written[n++] = w;
+      code[w++] = op;
+      if(opcode_has_operand(op)) {
+        code[w++] = operand;
+      }
+      dead = op == OP_JUMP || op == OP_EXIT || op == OP_TAIL_CALL;
+    }
+
+    // Point jumps into the rewritten code at where their targets went
+    for(size_t c = 0; c != w; c += kind[c] != DATA && opcode_has_operand(code[c]) ? 2 : 1) {
+      if(c >= tail) {
+        kind[c] = INSN;
+      }
+      if(kind[c] != DATA && (code[c] == OP_JUMP || code[c] == OP_JUMP_IF_ZERO || code[c] == OP_JUMP_IGNORED) &&
+          optimize_target(start_i, cells, code[c+1], target) && target >= tail) {
+        code[c+1] = start_i + moved[target] * sizeof(Cell);
+      }
+    }
+
+    memset(&code[w], 0, (cells - w) * sizeof(Cell));
+    memory_i = start_i + w * sizeof(Cell);
+    last_call_i = 0;
+  }
+
+#if WF_VERIFY
+  /***** VERIFIER */
+
+  // Verified code runs without the checks that only fail for invalid code. A word is verified as a
+  // whole, from its first instruction, so the VM only starts trusting code on entry to a verified
+  // word, and keeps trusting it through calls, which the verifier only allows into verified words
+
+  enum { VERIFY_CELLS = 0, VERIFY_ENTRIES = 1, VERIFY_EFFECTS = 2, VERIFY_KINDS = 3 };
+
+  static size_t verify_bits_size(size_t chunks) {
+    return chunks / 64 * VERIFY_KINDS * sizeof(uint64_t);
+  }
+
+  bool verify_bit(size_t chunk, int which) const {
+    return chunk < verify_chunks && ((verify_bits[chunk / 64 * VERIFY_KINDS + which] >> (chunk % 64)) & 1);
+  }
+
+  void verify_set(size_t chunk, int which) {
+    verify_bits[chunk / 64 * VERIFY_KINDS + which] |= (uint64_t) 1 << (chunk % 64);
+  }
+
+  /** Whether a relative address is the start of a verified word, in this State or its base */
+  bool verify_entry(ptrdiff_t a) const {
+    const State* owner = (size_t) a < base_i ? base : this;
+    return a % sizeof(Cell) == 0 && owner->verify_bit((size_t) a / sizeof(Cell), VERIFY_ENTRIES);
+  }
+
+  /** Move a mapping of size bytes to a new one of new_size bytes, returning 0 if mapping fails */
+  static void* verify_remap(void* old, size_t size, size_t new_size) {
+    void* m = mmap(0, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED) {
+      return 0;
+    }
+    if(old) {
+      memcpy(m, old, size);
+      munmap(old, size);
+    }
+    return m;
+  }
+
+  /** Make room in verify_bits for memory up to end_i, doubling its size so growth stays cheap */
+  bool verify_reserve(size_t end_i) {
+    size_t chunks = align(64, end_i / sizeof(Cell) + 1);
+    if(chunks <= verify_chunks) {
+      return true;
+    }
+    chunks = chunks < verify_chunks * 2 ? verify_chunks * 2 : chunks;
+    void* m = verify_remap(verify_bits, verify_bits_size(verify_chunks), verify_bits_size(chunks));
+    if(!m) {
+      return false;
+    }
+    verify_bits = (uint64_t*) m;
+    verify_chunks = chunks;
+    return true;
+  }
+
+  /** Words are spread over memory and mostly verified in order, so neighbours land in nearby slots */
+  static size_t verify_hash(size_t start_i) {
+    return start_i / sizeof(Cell);
+  }
+
+  /** Find the stack effect of the verified word at relative address a, in this State or its base */
+  bool verify_effect(ptrdiff_t a, StackEffect& e) const {
+    const State* owner = (size_t) a < base_i ? base : this;
+    if(owner->verify_effects_i == 0) {
+      return false;
+    }
+    size_t mask = owner->verify_effects_size - 1;
+    for(size_t i = verify_hash(a) & mask; owner->verify_effects[i].start_i; i = (i + 1) & mask) {
+      if(owner->verify_effects[i].start_i == (size_t) a) {
+        e = owner->verify_effects[i].effect;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /** Record the stack effect of a word just verified. Code never starts at 0, which marks free slots */
+  bool verify_effect_put(size_t start_i, StackEffect e) {
+    if((verify_effects_i + 1) * 2 > verify_effects_size &&
+        !verify_effects_rehash(verify_effects_size ? verify_effects_size * 2 : 256, SIZE_MAX)) {
+      return false;
+    }
+    size_t mask = verify_effects_size - 1, i = verify_hash(start_i) & mask;
+    for(; verify_effects[i].start_i && verify_effects[i].start_i != start_i; i = (i + 1) & mask) {}
+    verify_effects_i += verify_effects[i].start_i == 0;
+    verify_effects[i].start_i = start_i;
+    verify_effects[i].effect = e;
+    return true;
+  }
+
+  /** Move verify_effects to a table of size entries, keeping those of words below end_i */
+  bool verify_effects_rehash(size_t size, size_t end_i) {
+    VerifiedEffect* old = verify_effects;
+    size_t old_size = verify_effects_size;
+    void* m = verify_remap(0, 0, size * sizeof(VerifiedEffect));
+    if(!m) {
+      return false;
+    }
+    verify_effects = (VerifiedEffect*) m;
+    verify_effects_size = size;
+    verify_effects_i = 0;
+    for(size_t i = 0; i != old_size; i++) {
+      if(old[i].start_i && old[i].start_i < end_i) {
+        verify_effect_put(old[i].start_i, old[i].effect);
+      }
+    }
+    if(old) {
+      munmap(old, old_size * sizeof(VerifiedEffect));
+    }
+    return true;
+  }
+
+  enum { VERIFY_DECLARED = 1 << 16 };
+
+  /** Fill verify_cword_effects from the dictionary, returning the entry for slot */
+  uint32_t verify_cword_fill(size_t slot) {
+    if(!verify_cword_effects && !(verify_cword_effects = (uint32_t*) verify_remap(0, 0, cwords.size * sizeof(uint32_t)))) {
+      return 0;
+    }
+    memset(verify_cword_effects, 0, cwords.size * sizeof(uint32_t));
+    for(DictEntry* d = shared[S_LATEST].as<DictEntry>(); d; d = dict_follow(d->previous)) {
+      size_t s = (*d->data<ptrdiff_t>() + 1) / 2;
+      if((d->flags & DictEntry::FLAG_CWORD) && (d->flags & DictEntry::FLAG_EFFECT) && s < cwords.size) {
+        verify_cword_effects[s] = (uint32_t) (d->flags >> DictEntry::EFFECT_SHIFT) + VERIFY_DECLARED;
+      }
+    }
+    verify_cwords_i = cwords.i;
+    return slot < verify_cwords_i ? verify_cword_effects[slot] : 0;
+  }
+
+  /** Entry of verify_cword_effects for slot, filling it if C words were defined since it was filled */
+  uint32_t verify_cword_declared(size_t slot) {
+    return slot < verify_cwords_i ? verify_cword_effects[slot] : verify_cword_fill(slot);
+  }
+
+  /** Find the declared stack effect of the C word in slot */
+  bool verify_cword_effect(size_t slot, StackEffect& e) {
+    uint32_t declared = verify_cword_declared(slot);
+    e.in = declared & 0xff;
+    e.out = (declared >> 8) & 0xff;
+    e.peak = e.in > e.out ? e.in : e.out;
+    return declared & VERIFY_DECLARED;
+  }
+
+  /** Whether the C word called with cword index idx changed the stack by delta cells, as it declared */
+  bool verify_cword_held(ptrdiff_t idx, ptrdiff_t delta) {
+    uint32_t declared = verify_cword_declared((idx + 1) / 2);
+    return (declared & VERIFY_DECLARED) && delta == (ptrdiff_t) ((declared >> 8) & 0xff) - (ptrdiff_t) (declared & 0xff);
+  }
+
+  /**
+   * Whether the verified word at relative address a has a known stack effect that depth cells on
+   * the stack satisfy, in which case the VM can run it without checking the stack as it goes
+   */
+  bool verify_bound(ptrdiff_t a, size_t depth) const {
+    // Most calls are to words without one, which a bit tells apart without a lookup
+    const State* owner = (size_t) a < base_i ? base : this;
+    StackEffect e;
+    return owner->verify_bit((size_t) a / sizeof(Cell), VERIFY_EFFECTS) && verify_effect(a, e) && depth >= e.in &&
+      depth - e.in + e.peak <= stack_size;
+  }
+
+  /**
+   * Verify the bytecode in memory[start_i..end_i) as a word entered at start_i, and mark it if it
+   * checks out. Every instruction reachable from the start must have a known opcode and lie within
+   * the word, jumps must land on instructions rather than operands, calls must go to verified words
+   * or the word itself, C words must be registered, and locals must have been set on every path to
+   * where they are read.
+   *
+   * It also works out the word's stack effect, if every path to an instruction leaves the stack at
+   * the same depth and every word it calls has a known effect. Recursion other than tail calls, C
+   * words that declare no effect and OP_NATIVE leave it unknown
+   */
+  bool verify_word(size_t start_i, size_t end_i) {
+    size_t cells = (end_i - start_i) / sizeof(Cell);
+    if(start_i < base_i || start_i % sizeof(Cell) || end_i > memory_i || cells == 0 || !verify_reserve(end_i) ||
+        !work_reserve(cells * 2)) {
+      return false;
+    }
+
+    // Scratch space holds, for each cell, whether it is unreached or the operand of an instruction,
+    // or else the fewest locals set on any path to the instruction there. Paths are followed until
+    // the counts stop going down. After that comes the depth of the stack, relative to entry, on the
+    // first path found to each instruction
+    const uint32_t UNREACHED = (uint32_t) -1, OPERAND = (uint32_t) -2, MAX_LOCALS = (uint32_t) -3;
+    uint32_t* reached = work;
+    int32_t* depth = (int32_t*) &reached[cells];
+    for(size_t c = 0; c != cells; c++) {
+      reached[c] = UNREACHED;
+    }
+    reached[0] = 0;
+    depth[0] = 0;
+
+    const ptrdiff_t* code = (const ptrdiff_t*) &memory[start_i];
+    bool ok = true, changed = true, known = true, exits = false;
+    // Lowest and highest depths reached, and the depth at exit
+    ptrdiff_t low = 0, high = 0, exit_depth = 0;
+    auto flow = [&](size_t target, uint32_t n, ptrdiff_t d) {
+      if(target >= cells || reached[target] == OPERAND) {
+        return false;
+      }
+      if(reached[target] == UNREACHED) {
+        depth[target] = (int32_t) d;
+      } else if(depth[target] != d) {
+        known = false;
+      }
+      if(n < reached[target]) {
+        reached[target] = n;
+        changed = true;
+      }
+      return true;
+    };
+    auto jump_target = [&](ptrdiff_t operand, size_t& target) {
+      if(operand < (ptrdiff_t) start_i || operand >= (ptrdiff_t) end_i || (operand - start_i) % sizeof(Cell)) {
+        return false;
+      }
+      target = (operand - start_i) / sizeof(Cell);
+      return true;
+    };
+    // Apply the effect of an instruction or a call to the depth
+    auto apply = [&](ptrdiff_t& d, StackEffect e) {
+      low = d - e.in < low ? d - e.in : low;
+      high = d - e.in + e.peak > high ? d - e.in + e.peak : high;
+      d += (ptrdiff_t) e.out - e.in;
+    };
+    // Every exit must leave the stack at the same depth
+    auto leave = [&](ptrdiff_t d) {
+      known = known && (!exits || exit_depth == d);
+      exits = true;
+      exit_depth = d;
+    };
+
+    while(ok && changed) {
+      changed = false;
+      for(size_t c = 0; ok && c != cells; c++) {
+        uint32_t n = reached[c];
+        if(n >= OPERAND) {
+          continue;
+        }
+        ptrdiff_t op = code[c], operand = 0, d = depth[c];
+        size_t next = c + 1, target = 0;
+        switch(op) {
+          case OP_PUSH_IMMEDIATE: case OP_CALL_FORTH: case OP_CALL_C: case OP_JUMP_IF_ZERO: case OP_JUMP:
+          case OP_JUMP_IGNORED: case OP_LOCAL_PUSH: case OP_TAIL_CALL: case OP_NATIVE:
+            if(next == cells || (reached[next] != UNREACHED && reached[next] != OPERAND)) {
+              ok = false;
+              continue;
+            }
+            reached[next] = OPERAND;
+            operand = code[next++];
+            break;
+          default:
+            if(op <= OP_UNKNOWN || op >= OP_COUNT) {
+              ok = false;
+              continue;
+            }
+        }
+
+        StackEffect e = {0, 0, 0};
+        switch(op) {
+          case OP_ADD: case OP_SUB: case OP_MUL: case OP_GT: case OP_EQ: case OP_MOD:
+            e = {2, 1, 2};
+            break;
+          case OP_SWAP:
+            e = {2, 2, 2};
+            break;
+          case OP_STORE:
+            e = {2, 0, 2};
+            break;
+          case OP_DUP:
+            e = {1, 2, 2};
+            break;
+          case OP_FETCH:
+            e = {1, 1, 1};
+            break;
+          case OP_DROP: case OP_LOCAL_SET: case OP_JUMP_IF_ZERO:
+            e = {1, 0, 1};
+            break;
+          case OP_PUSH_IMMEDIATE: case OP_LOCAL_PUSH:
+            e = {0, 1, 1};
+            break;
+          case OP_CALL_FORTH:
+            known = known && operand != (ptrdiff_t) start_i && verify_effect(operand, e);
+            break;
+          case OP_TAIL_CALL:
+            // Calling itself is a jump back to the start, where the depth must match
+            if(operand == (ptrdiff_t) start_i) {
+              known = known && d == 0;
+            } else {
+              known = known && verify_effect(operand, e);
+            }
+            break;
+          case OP_CALL_C:
+            known = known && verify_cword_effect((operand + 1) / 2, e);
+            break;
+          case OP_NATIVE:
+            known = false;
+            break;
+        }
+        apply(d, e);
+
+        switch(op) {
+          case OP_CALL_FORTH:
+            ok = (operand == (ptrdiff_t) start_i || verify_entry(operand)) && flow(next, n, d);
+            break;
+          case OP_TAIL_CALL:
+            ok = operand == (ptrdiff_t) start_i || verify_entry(operand);
+            if(operand != (ptrdiff_t) start_i) {
+              leave(d);
+            }
+            break;
+          case OP_CALL_C:
+            ok = operand > 0 && operand % 2 == 1 && (size_t) (operand + 1) / 2 < cwords.i &&
+              cwords.data[(operand + 1) / 2] != 0 && flow(next, n, d);
+            break;
+          case OP_JUMP_IF_ZERO:
+            ok = jump_target(operand, target) && flow(target, n, d) && flow(next, n, d);
+            break;
+          case OP_JUMP: case OP_JUMP_IGNORED:
+            ok = jump_target(operand, target) && flow(target, n, d);
+            break;
+          case OP_LOCAL_PUSH:
+            ok = operand >= 0 && operand < (ptrdiff_t) n && flow(next, n, d);
+            break;
+          case OP_LOCAL_SET:
+            ok = flow(next, n < MAX_LOCALS ? n + 1 : n, d);
+            break;
+          case OP_EXIT: case OP_NATIVE:
+            // OP_NATIVE runs the rest of the word as machine code, then exits
+            leave(d);
+            break;
+          default:
+            ok = flow(next, n, d);
+        }
+      }
+    }
+
+    if(ok) {
+      for(size_t c = 0; c != cells; c++) {
+        // Operands of OP_PUSH_IMMEDIATE can change without invalidating anything, e.g. with to
+        if(reached[c] < OPERAND || (reached[c] == OPERAND && code[c - 1] != OP_PUSH_IMMEDIATE)) {
+          verify_set(start_i / sizeof(Cell) + c, VERIFY_CELLS);
+        }
+      }
+      verify_set(start_i / sizeof(Cell), VERIFY_ENTRIES);
+      verify_end = end_i > verify_end ? end_i : verify_end;
+      // Words that never exit have no effect to speak of
+      if(known && exits && high - low <= UINT16_MAX) {
+        StackEffect e = {(uint16_t) -low, (uint16_t) (exit_depth - low), (uint16_t) (high - low)};
+        if(verify_effect_put(start_i, e)) {
+          verify_set(start_i / sizeof(Cell), VERIFY_EFFECTS);
+        }
+      }
+    }
+    return ok;
+  }
+
+  /** Forget what was verified */
+  void verify_clear() {
+    if(verify_bits) {
+      memset(verify_bits, 0, verify_bits_size(verify_chunks));
+    }
+    verify_end = 0;
+    verify_stale = false;
+    if(verify_effects) {
+      memset(verify_effects, 0, verify_effects_size * sizeof(VerifiedEffect));
+    }
+    verify_effects_i = 0;
+    verify_cwords_i = 0;
+  }
+
+  /**
+   * Verify every word in this State's own dictionary, e.g. after loading an image. Entries are
+   * found newest first, before the words they call, so this goes over them until no more check out
+   */
+  void verify_all() {
+    verify_clear();
+    for(bool changed = true; changed;) {
+      changed = false;
+      size_t end_i = memory_i;
+      for(DictEntry* d = shared[S_LATEST].as<DictEntry>(); d && !in_base(d); d = dict_follow(d->previous)) {
+        size_t start_i = real_to_raddr(d->data<ptrdiff_t>());
+        if((d->flags & DictEntry::FLAG_CWORD) == 0 && !verify_entry(start_i) && verify_word(start_i, end_i)) {
+          changed = true;
+        }
+        // Locals are defined in the middle of the word using them, which carries on past them
+        if(d->flags != DictEntry::FLAG_COMPILE_ONLY + DictEntry::FLAG_IMMEDIATE) {
+          end_i = real_to_raddr((ptrdiff_t*) d);
+        }
+      }
+    }
+  }
+
+  /** Verify a word or handle that was just compiled, and everything else if code was demoted */
+  void verify(size_t start_i, size_t end_i) {
+    if(verify_stale) {
+      verify_all();
+    }
+    if(!verify_entry(start_i)) {
+      verify_word(start_i, end_i);
+    }
+  }
+
+  /**
+   * Stop running any code unchecked, because something verified code relies on was overwritten.
+   * Hosts writing to code in memory directly must call this. The next definition verifies the
+   * dictionary again, but handles from compile stay demoted
+   */
+  void verify_demote() {
+    verify_clear();
+    verify_stale = true;
+    verify_epoch++;
+    for(size_t i = 0; i != ri; i++) {
+      rstack[i].verified = false;
+      rstack[i].bounded = false;
+    }
+  }
+
+  /** Demote verified code if a cell stored at a overlaps it, returning whether it did */
+  bool verify_store(ptrdiff_t a) {
+    if((size_t) a >= verify_end || (!verify_bit((size_t) a / sizeof(Cell), VERIFY_CELLS) &&
+        !verify_bit(((size_t) a + sizeof(Cell) - 1) / sizeof(Cell), VERIFY_CELLS))) {
+      return false;
+    }
+    verify_demote();
+    return true;
+  }
+
+  /**
+   * Forget what was verified at or past memory_i, after restoring a checkpoint. Code running now
+   * may be among what was forgotten, so it runs checked from here on
+   */
+  void verify_truncate() {
+    for(size_t chunk = memory_i / sizeof(Cell); chunk < verify_chunks && chunk * sizeof(Cell) < verify_end; chunk++) {
+      for(int which = 0; which != VERIFY_KINDS; which++) {
+        verify_bits[chunk / 64 * VERIFY_KINDS + which] &= ~((uint64_t) 1 << (chunk % 64));
+      }
+    }
+    verify_end = verify_end > memory_i ? memory_i : verify_end;
+    if(verify_effects_i && !verify_effects_rehash(verify_effects_size, memory_i)) {
+      memset(verify_effects, 0, verify_effects_size * sizeof(VerifiedEffect));
+      verify_effects_i = 0;
+    }
+    verify_cwords_i = verify_cwords_i > cwords.i ? cwords.i : verify_cwords_i;
+    verify_epoch++;
+    for(size_t i = 0; i != ri; i++) {
+      rstack[i].verified = false;
+      rstack[i].bounded = false;
+    }
+  }
+
+  /**
+   * Check the stack as it's used again, e.g. because a C word didn't keep to its declared effect,
+   * so the effects of words calling it don't hold
+   */
+  void verify_unbound() {
+    for(size_t i = 0; i != ri; i++) {
+      rstack[i].bounded = false;
+    }
+  }
+#endif
+
+  /***** VIRTUAL MACHINE */
+
+#if WF_PROFILE
+  /***** PROFILER */
+
+  void profile_reset() {
+    memset(&profile, 0, sizeof(profile));
+  }
+
+  static uint64_t profile_now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  /** Find the profile of a word, adding it if insert is set and there is room */
+  ProfileWord* profile_find(ptrdiff_t key, bool cword, bool insert) {
+    size_t h = (size_t) key * 2654435761u;
+    for(size_t i = 0; i != WF_PROFILE_WORDS; i++) {
+      ProfileWord& w = profile.words[(h + i) % WF_PROFILE_WORDS];
+      if(w.calls == 0) {
+        if(!insert) {
+          return 0;
+        }
+        w.key = key;
+        w.cword = cword;
+        return &w;
+      }
+      if(w.key == key && w.cword == cword) {
+        return &w;
+      }
+    }
+    if(insert) {
+      profile.dropped++;
+    }
+    return 0;
+  }
+
+  /** Return the profile of a word, or null if it hasn't been called while profiling */
+  const ProfileWord* profile_lookup(const char* name) {
+    DictEntry* d = lookup(name);
+    if(!d) {
+      return 0;
+    }
+    if(d->flags & DictEntry::FLAG_CWORD) {
+      return profile_find(*d->data<ptrdiff_t>(), true, false);
+    }
+    return profile_find((ptrdiff_t) real_to_raddr(d->data<ptrdiff_t>()), false, false);
+  }
+
+  /** Find the name of a profiled word, if it has one */
+  const char* profile_name(const ProfileWord& w) const {
+    for(DictEntry* d = shared[S_LATEST].as<DictEntry>(); d; d = dict_follow(d->previous)) {
+      bool cword = d->flags & DictEntry::FLAG_CWORD;
+      if(cword == w.cword && w.key == (cword ? *d->data<ptrdiff_t>() : (ptrdiff_t) real_to_raddr(d->data<ptrdiff_t>()))) {
+        return d->name.bytes;
+      }
+    }
+    return "<anonymous>";
+  }
+
+  /** Print instruction counts, then words by exclusive time */
+  void profile_report(FILE* out) {
+    fprintf(out, "%-24s %12s\n", "opcode", "count");
+    for(size_t i = 0; i != OP_COUNT; i++) {
+      if(profile.opcodes[i]) {
+        fprintf(out, "%-24s %12zu\n", opcode_description(i) ? opcode_description(i) : "OP_UNKNOWN", profile.opcodes[i]);
+      }
+    }
+
+    ProfileWord* sorted[WF_PROFILE_WORDS];
+    size_t count = 0;
+    for(size_t i = 0; i != WF_PROFILE_WORDS; i++) {
+      ProfileWord* w = &profile.words[i];
+      if(w->calls == 0) {
+        continue;
+      }
+      size_t j = count++;
+      for(; j > 0 && sorted[j-1]->exclusive < w->exclusive; j--) {
+        sorted[j] = sorted[j-1];
+      }
+      sorted[j] = w;
+    }
+
+    fprintf(out, "%-24s %12s %14s %14s\n", "word", "calls", "inclusive ms", "exclusive ms");
+    for(size_t i = 0; i != count; i++) {
+      fprintf(out, "%-24s %12zu %14.3f %14.3f\n", profile_name(*sorted[i]), sorted[i]->calls,
+        sorted[i]->inclusive / 1e6, sorted[i]->exclusive / 1e6);
+    }
+    if(profile.dropped) {
+      fprintf(out, "%zu calls to words not profiled, increase WF_PROFILE_WORDS\n", profile.dropped);
+    }
+  }
+
+  /** Start profiling a Forth word on entry */
+  void profile_enter(ProfileFrame& f, ptrdiff_t* code) {
+    f.word = profiling ? profile_find((ptrdiff_t) real_to_raddr(code), false, true) : 0;
+    if(f.word) {
+      f.word->calls++;
+      f.word->active++;
+      f.start = profile_now();
+      f.children = 0;
+    }
+  }
+
+  /** Record time spent in a Forth word on exit. Returns the time it exited, or 0 if not profiled */
+  uint64_t profile_exit(ProfileFrame& f) {
+    if(!f.word) {
+      return 0;
+    }
+    uint64_t now = profile_now(), elapsed = now - f.start;
+    f.word->exclusive += elapsed - f.children;
+    if(--f.word->active == 0) {
+      f.word->inclusive += elapsed;
+    }
+    f.word = 0;
+    return now;
+  }
+
+  /** Save a word's profile on the return stack before it calls another */
+  void profile_call(ProfileFrame& f, Frame& frame) {
+    if(f.word) {
+      f.call_start = profile_now();
+    }
+    frame.profile = f;
+  }
+
+  /** Restore a word's profile when a call returns to it */
+  void profile_return(ProfileFrame& f, Frame& frame, uint64_t now) {
+    f = frame.profile;
+    if(f.word) {
+      f.children += (now ? now : profile_now()) - f.call_start;
+    }
+  }
+
+  /** Time a call to a C word */
+  Error profile_cword(ProfileFrame& f, ptrdiff_t idx, c_word_t cw) {
+    ProfileWord* w = profiling ? profile_find(idx, true, true) : 0;
+    if(!w) {
+      return cw(*this);
+    }
+    uint64_t start = profile_now();
+    Error e = cw(*this);
+    uint64_t elapsed = profile_now() - start;
+    w->calls++;
+    w->inclusive += elapsed;
+    w->exclusive += elapsed;
+    if(f.word) {
+      f.children += elapsed;
+    }
+    return e;
+  }
+
+  // Records words abandoned when exec returns early
+  struct ProfileSave {
+    ProfileSave(State& state_, ProfileFrame& current_): state(state_), current(current_), rbase(state.ri) {}
+    ~ProfileSave() {
+      state.profile_exit(current);
+      for(size_t i = state.ri; i > rbase; i--) {
+        state.profile_exit(state.rstack[i-1].profile);
+      }
+    }
+
+    State& state;
+    ProfileFrame& current;
+    size_t rbase;
+  };
+#endif
+
+  /***** GUARD PAGES */
+
+  /** An exec of a State with guard pages, which a fault on one of them jumps back to */
+  struct GuardJump {
+    State* state;
+    GuardJump* previous;
+    sigjmp_buf jump;
+    uintptr_t fault;
+    /**
+     * Cleared while the VM loop or machine code calls C words, whose faults aren't caught: jumping
+     * out of them could skip their destructors
+     */
+    volatile sig_atomic_t armed;
+  };
+
+  /** Innermost exec on this thread that catches guard page faults */
+  static GuardJump*& guard_current() {
+    static thread_local GuardJump* current = 0;
+    return current;
+  }
+
+  /** Handler that SIGSEGV had before guard_install, which gets faults that aren't on guard pages */
+  static struct sigaction& guard_previous() {
+    static struct sigaction previous;
+    return previous;
+  }
+
+  /** Install the SIGSEGV handler once per process */
+  static void guard_install() {
+    static bool installed = [] {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = guard_fault;
+      // The handler jumps out rather than returning, so SIGSEGV must not stay blocked
+      sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+      sigemptyset(&sa.sa_mask);
+      return sigaction(SIGSEGV, &sa, &guard_previous()) == 0;
+    }();
+    (void) installed;
+  }
+
+  /**
+   * Which side of the memory [start, start + bytes) a fault at address a was on, if it was on the
+   * guard pages around it: -1 for below, 1 for above, and 0 for neither
+   */
+  int guard_side(const void* start, size_t bytes, uintptr_t a) const {
+    uintptr_t lo = (uintptr_t) start, hi = lo + bytes;
+    return a < lo && a >= lo - guard_size ? -1 : a >= hi && a < hi + guard_size ? 1 : 0;
+  }
+
+  /** The error for a fault at address a, or E_OK if it wasn't on one of this State's guard pages */
+  Error guard_error(uintptr_t a) const {
+    int side;
+    if((side = guard_side(stack, stack_size * sizeof(Cell), a))) {
+      return side < 0 ? E_STACK_UNDERFLOW : E_STACK_OVERFLOW;
+    }
+    if((side = guard_side(locals.data, locals.size * sizeof(ptrdiff_t), a))) {
+      // The same error Stack::push gives
+      return side < 0 ? E_STACK_UNDERFLOW : E_OUT_OF_MEMORY;
+    }
+    if(guard_side(rstack, rstack_size * sizeof(Frame), a) > 0) {
+      return E_STACK_OVERFLOW;
+    }
+    return E_OK;
+  }
+
+  static void guard_fault(int sig, siginfo_t* info, void* context) {
+    GuardJump* g = guard_current();
+    if(g && g->armed && g->state->guard_error((uintptr_t) info->si_addr) != E_OK) {
+      g->fault = (uintptr_t) info->si_addr;
+      siglongjmp(g->jump, 1);
+    }
+    // Not ours: pass it on, or put the default action back and let the instruction fault again
+    struct sigaction& previous = guard_previous();
+    if((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction) {
+      previous.sa_sigaction(sig, info, context);
+    } else if(previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+      previous.sa_handler(sig);
+    } else {
+      signal(SIGSEGV, SIG_DFL);
+    }
+  }
+
+  // Convenience struct to unwind locals and the return stack if exec returns early
+  struct FrameSave {
+    FrameSave(State& state_, size_t locals_i_, size_t ri_): state(state_), locals_i(locals_i_), ri(ri_), unwind(true) {}
+    ~FrameSave() {
+      if(!unwind) {
+        return;
+      }
+      if(state.locals.i != locals_i) {
         state.locals.i = locals_i;
         WF_LOG(WF_VM, "% restored locals to " << locals_i);
       }
+      state.ri = ri;
     }
 
     State& state;
-    size_t locals_i;
+    size_t locals_i, ri;
+    /** Cleared to leave frames in place for resuming */
+    bool unwind;
   };
 
-  /** Execute user defined Forth code */
+  /**
+   * What an exec_loop cleans up after. It lives outside the loop, so that a fault on a guard page
+   * can jump out of the loop without skipping any destructors
+   */
+  struct ExecSave {
+    ExecSave(State& state, size_t locals_i, size_t ri): fs(state, locals_i, ri), guard(0)
+#if WF_PROFILE
+      , prof(), ps(state, prof)
+#endif
+      {}
+
+    FrameSave fs;
+    /** The GuardJump catching faults in the loop, if the State has guard pages */
+    GuardJump* guard;
+#if WF_PROFILE
+    ProfileFrame prof;
+    ProfileSave ps;
+#endif
+  };
+
+  /** Stop or start catching guard page faults, around calls out of the VM loop */
+  static void guard_arm(ExecSave& save, bool armed) {
+    if(save.guard) {
+      save.guard->armed = armed;
+    }
+  }
+
+  /**
+   * Run the VM loop, catching faults on the guard pages. A fault abandons the code like any other
+   * error, leaving the data stack empty after an underflow and full after an overflow
+   */
+  Error exec_guarded(ptrdiff_t* code, size_t ip, size_t rbase, size_t locals_i, ExecSave& save) {
+    GuardJump g;
+    g.state = this;
+    g.previous = guard_current();
+    g.armed = 1;
+    guard_current() = &g;
+    save.guard = &g;
+#if WF_JIT
+    // Machine code that faults doesn't get to restore this
+    char* stack_limit = jit_stack_limit;
+#endif
+    // No signal mask to restore, since the handler doesn't block SIGSEGV. The loop holds nothing
+    // with a destructor, and save unwinds its frames and locals once this returns
+    if(sigsetjmp(g.jump, 0)) {
+      guard_current() = g.previous;
+      int side = guard_side(stack, stack_size * sizeof(Cell), g.fault);
+      si = side < 0 ? 0 : side > 0 ? stack_size : si;
+#if WF_JIT
+      jit_stack_limit = stack_limit;
+#endif
+      return guard_error(g.fault);
+    }
+    Error e = exec_loop(code, ip, rbase, locals_i, save);
+    guard_current() = g.previous;
+    return e;
+  }
+
+  /**
+   * Execute user defined Forth code. Calls between Forth words push a Frame onto the return
+   * stack rather than recursing, so this only returns once the word it was given exits
+   */
   Error exec(ptrdiff_t* code_relative) {
+    WF_CHECKF(raddr_valid(code_relative), "exec got invalid address %ld", code_relative);
+    return exec_from(raddr_to_real(code_relative), 0, ri, locals.i);
+  }
+
+  /**
+   * Execute Forth code so that it can be suspended: if a C word it calls returns E_PENDING through
+   * suspend, or, with WF_PREEMPT, it runs for budget instructions (0 for no limit), this returns
+   * E_PENDING or E_YIELD. The return stack, locals and data stack are left as they are, and resume
+   * carries on exactly where it stopped. Other code shouldn't be run on the State while it is
+   * suspended. Code run by C words, such as the interpreter, can't be suspended
+   */
+  Error exec(ptrdiff_t* code_relative, size_t budget_) {
+    WF_CHECKF(raddr_valid(code_relative), "exec got invalid address %ld", code_relative);
+    WF_CHECKF(suspended.code ? E_PENDING : E_OK, "can't exec while suspended code hasn't finished");
+    pending_retry = false;
+    return exec_suspendable(raddr_to_real(code_relative), 0, ri, locals.i, budget_);
+  }
+
+  /**
+   * Resume suspended code, running it for at most another budget instructions. For E_PENDING,
+   * push the results of the operation first, unless the word suspended with suspend_retry
+   */
+  Error resume(size_t budget_ = 0) {
+    WF_CHECKF(suspended.code ? E_OK : E_INVALID_ADDRESS, "nothing to resume");
+    Frame f = suspended;
+    suspended.code = 0;
+    pending = 0;
+    return exec_suspendable(f.code, f.ip, suspended_rbase, f.locals_i, budget_);
+  }
+
+  /** Abandon suspended code, dropping its frames and locals. The data stack is left as it is */
+  void cancel() {
+    if(suspended.code) {
+      locals.i = ri > suspended_rbase ? rstack[suspended_rbase].locals_i : suspended.locals_i;
+      ri = suspended_rbase;
+      suspended.code = 0;
+      pending = 0;
+      pending_retry = false;
+    }
+  }
+
+  /**
+   * For C words that start an operation and return without waiting for it: returns E_PENDING,
+   * which suspends the code calling the word, and leaves token in pending for the host to see
+   */
+  Error suspend(void* token) {
+    pending = token;
+    pending_retry = false;
+    return E_PENDING;
+  }
+
+  /**
+   * For C words that can't go ahead yet, such as receiving from an empty channel: like suspend,
+   * but the word leaves the stack as it found it and is called again on resume
+   */
+  Error suspend_retry(void* token) {
+    pending = token;
+    pending_retry = true;
+    return E_PENDING;
+  }
+
+  Error exec_suspendable(ptrdiff_t* code, size_t ip, size_t rbase, size_t locals_i, size_t budget_) {
+#if WF_PREEMPT
+    budget = budget_;
+#else
+    (void) budget_;
+#endif
+    suspendable = true;
+    return exec_from(code, ip, rbase, locals_i);
+  }
+
+  /**
+   * Run code from ip, with frames from rbase on the return stack and the locals of the current
+   * word from locals_i, until the word at rbase exits
+   */
+  Error exec_from(ptrdiff_t* code, size_t ip, size_t rbase, size_t locals_i) {
+    // Save locals and return stack to clean up after errors. Frames below rbase belong to whoever
+    // called us, e.g. a C word invoking exec
+    ExecSave save(*this, ri > rbase ? rstack[rbase].locals_i : locals_i, rbase);
+    return guard_size ? exec_guarded(code, ip, rbase, locals_i, save) : exec_loop(code, ip, rbase, locals_i, save);
+  }
+
+  /** The VM loop, see exec_from. Nothing in it may have a destructor, see ExecSave */
+  Error exec_loop(ptrdiff_t* code, size_t ip, size_t rbase, size_t locals_i, ExecSave& save) {
+#if WF_COUNT_INSTRUCTIONS
+# define WF_VM_COUNT() count++;
+# define WF_VM_COUNT_TOTAL() instruction_count += count;
+#else
+# define WF_VM_COUNT()
+# define WF_VM_COUNT_TOTAL()
+#endif
+#if WF_PREEMPT
+# define WF_VM_BUDGET() if(budget_left-- == 0) { goto suspend; }
+#else
+# define WF_VM_BUDGET()
+#endif
+#if WF_PROFILE
+# define WF_VM_PROFILE_OP() if(profiling && code[ip] >= 0 && code[ip] < OP_COUNT) { profile.opcodes[code[ip]]++; }
+# define WF_VM_PROFILE_ENTER() profile_enter(prof, code);
+# define WF_VM_PROFILE_CALL() profile_call(prof, rstack[ri]);
+# define WF_VM_PROFILE_TAIL_CALL() profile_exit(prof); profile_enter(prof, code);
+# define WF_VM_PROFILE_EXIT() uint64_t exited = profile_exit(prof);
+# define WF_VM_PROFILE_RETURN() profile_return(prof, rstack[ri], exited);
+# define WF_VM_CALL_C(idx, cw) profile_cword(prof, idx, cw)
+#else
+# define WF_VM_PROFILE_OP()
+# define WF_VM_PROFILE_ENTER()
+# define WF_VM_PROFILE_CALL()
+# define WF_VM_PROFILE_TAIL_CALL()
+# define WF_VM_PROFILE_EXIT()
+# define WF_VM_PROFILE_RETURN()
+# define WF_VM_CALL_C(idx, cw) cw(*this)
+#endif
+// Words whose stack use was checked on entry run through a second dispatch table, which enters
+// instructions past their stack checks. Only computed goto dispatch has them
+#define WF_VM_BOUNDS (WF_VERIFY && WF_COMPUTED_GOTO)
 #if WF_COMPUTED_GOTO
 # define WF_VM_CASE(label) LABEL_##label
-# define WF_VM_DISPATCH() goto *dispatch_table[code[ip++]];
+# if WF_VM_BOUNDS
+#  define WF_VM_DISPATCH() WF_VM_BUDGET() WF_VM_COUNT() WF_VM_PROFILE_OP() goto *dispatch[code[ip++]];
+# else
+#  define WF_VM_DISPATCH() WF_VM_BUDGET() WF_VM_COUNT() WF_VM_PROFILE_OP() goto *dispatch_table[code[ip++]];
+# endif
+# define WF_VM_START() WF_VM_DISPATCH()
 # define WF_VM_SWITCH()
+# define WF_VM_DEFAULT()
     static void* dispatch_table[] = {
       &&LABEL_OP_UNKNOWN,
-      &&LABEL_OP_PUSH_IMMEDIATE,
+      &&LABEL_OP_PUSH_IMMEDIATE,
+      &&LABEL_OP_CALL_FORTH,
+      &&LABEL_OP_CALL_C,
+      &&LABEL_OP_JUMP_IF_ZERO,
+      &&LABEL_OP_JUMP,
+      &&LABEL_OP_JUMP_IGNORED,
+      &&LABEL_OP_LOCAL_PUSH,
+      &&LABEL_OP_LOCAL_SET,
+      &&LABEL_OP_EXIT,
+      &&LABEL_OP_ADD,
+      &&LABEL_OP_SUB,
+      &&LABEL_OP_MUL,
+      &&LABEL_OP_GT,
+      &&LABEL_OP_EQ,
+      &&LABEL_OP_MOD,
+      &&LABEL_OP_DUP,
+      &&LABEL_OP_DROP,
+      &&LABEL_OP_SWAP,
+      &&LABEL_OP_FETCH,
+      &&LABEL_OP_STORE,
+      &&LABEL_OP_TAIL_CALL,
+      &&LABEL_OP_NATIVE,
+    };
+#if WF_VM_BOUNDS
+    static void* bounded_table[] = {
+      &&LABEL_OP_UNKNOWN,
+      &&LABEL_BOUNDED_OP_PUSH_IMMEDIATE,
+      &&LABEL_OP_CALL_FORTH,
+      &&LABEL_OP_CALL_C,
+      &&LABEL_BOUNDED_OP_JUMP_IF_ZERO,
+      &&LABEL_OP_JUMP,
+      &&LABEL_OP_JUMP_IGNORED,
+      &&LABEL_BOUNDED_OP_LOCAL_PUSH,
+      &&LABEL_BOUNDED_OP_LOCAL_SET,
+      &&LABEL_OP_EXIT,
+      &&LABEL_BOUNDED_OP_ADD,
+      &&LABEL_BOUNDED_OP_SUB,
+      &&LABEL_BOUNDED_OP_MUL,
+      &&LABEL_BOUNDED_OP_GT,
+      &&LABEL_BOUNDED_OP_EQ,
+      &&LABEL_BOUNDED_OP_MOD,
+      &&LABEL_BOUNDED_OP_DUP,
+      &&LABEL_BOUNDED_OP_DROP,
+      &&LABEL_BOUNDED_OP_SWAP,
+      &&LABEL_BOUNDED_OP_FETCH,
+      &&LABEL_BOUNDED_OP_STORE,
+      &&LABEL_OP_TAIL_CALL,
+      &&LABEL_OP_NATIVE,
+    };
+    // With guard pages the stack ops run into them instead of checking bounds, and locals likewise.
+    // The exceptions are ops that can underflow without touching memory: dup and @ with the top of
+    // the stack cached, and drop without
+    static void* guarded_table[] = {
+      &&LABEL_OP_UNKNOWN,
+      &&LABEL_BOUNDED_OP_PUSH_IMMEDIATE,
       &&LABEL_OP_CALL_FORTH,
       &&LABEL_OP_CALL_C,
-      &&LABEL_OP_JUMP_IF_ZERO,
+      &&LABEL_BOUNDED_OP_JUMP_IF_ZERO,
       &&LABEL_OP_JUMP,
       &&LABEL_OP_JUMP_IGNORED,
-      &&LABEL_OP_LOCAL_PUSH,
-      &&LABEL_OP_LOCAL_SET,
+      &&LABEL_BOUNDED_OP_LOCAL_PUSH,
+      &&LABEL_GUARDED_OP_LOCAL_SET,
       &&LABEL_OP_EXIT,
+      &&LABEL_BOUNDED_OP_ADD,
+      &&LABEL_BOUNDED_OP_SUB,
+      &&LABEL_BOUNDED_OP_MUL,
+      &&LABEL_BOUNDED_OP_GT,
+      &&LABEL_BOUNDED_OP_EQ,
+      &&LABEL_BOUNDED_OP_MOD,
+#if WF_STACK_CACHE
+      &&LABEL_OP_DUP,
+#else
+      &&LABEL_BOUNDED_OP_DUP,
+#endif
+#if WF_STACK_CACHE
+      &&LABEL_BOUNDED_OP_DROP,
+#else
+      &&LABEL_OP_DROP,
+#endif
+      &&LABEL_BOUNDED_OP_SWAP,
+#if WF_STACK_CACHE
+      &&LABEL_OP_FETCH,
+#else
+      &&LABEL_BOUNDED_OP_FETCH,
+#endif
+      &&LABEL_BOUNDED_OP_STORE,
+      &&LABEL_OP_TAIL_CALL,
+      &&LABEL_OP_NATIVE,
     };
+    // A State with guard pages runs everything through guarded_table, and never checks bounds
+    void** checked_dispatch = guard_size ? guarded_table : dispatch_table;
+    void** bounded_dispatch = guard_size ? guarded_table : bounded_table;
+    void** dispatch = checked_dispatch;
+#endif
 #else 
 # define WF_VM_CASE(label) case label
 # define WF_VM_DISPATCH() break;
-# define WF_VM_SWITCH() switch(code[ip++])
+# define WF_VM_START()
+# define WF_VM_SWITCH() WF_VM_BUDGET() WF_VM_COUNT() WF_VM_PROFILE_OP() switch(code[ip++])
+# define WF_VM_DEFAULT() default:
 #endif
-    WF_CHECKF(raddr_valid(code_relative), "exec got invalid address %ld", code_relative);
-    ptrdiff_t* code = raddr_to_real(code_relative);
-    // Save locals spot to clean up afterwards
-    LocalsSave ls(*this);
-    // TODO: Check that code addresses are valid memory.
-    size_t ip = 0;
+// The VM keeps the stack index in a local, and with WF_STACK_CACHE the top of the stack as well, so
+// they can live in registers. stack[] only holds values below the top, and si is stale, until
+// WF_VM_SYNC writes them back
+#if WF_STACK_CACHE
+// Top of the stack
+# define WF_VM_TOS tos
+// Write the cached top of the stack back, to the dead stack[0] if the stack is empty
+# define WF_VM_SPILL() stack[lsi ? lsi - 1 : 0].bits = tos
+# define WF_VM_FILL() tos = stack[lsi ? lsi - 1 : 0].bits
+#else
+# define WF_VM_TOS stack[lsi-1].bits
+# define WF_VM_SPILL()
+# define WF_VM_FILL()
+#endif
+// Value n cells below the top of the stack
+#define WF_VM_NOS(n) stack[lsi-1-(n)].bits
+// Push a value onto the stack, which WF_VM_REQUIRE_ROOM checked has room for it
+#define WF_VM_PUSH(v) do { \
+          ptrdiff_t pushed = (v); \
+          WF_VM_SPILL(); \
+          lsi++; \
+          WF_VM_TOS = pushed; \
+        } while(0)
+// Remove the top value from the stack
+#define WF_VM_POP(n) do { lsi -= (n); WF_VM_FILL(); } while(0)
+// Make stack and si reflect the VM's stack, before anything outside of the VM loop looks at it
+#define WF_VM_SYNC() do { WF_VM_SPILL(); si = lsi; } while(0)
+// Pick up changes made to the stack outside the VM loop
+#define WF_VM_RELOAD() do { lsi = si; WF_VM_FILL(); } while(0)
+#define WF_VM_RETURN(e) do { WF_VM_SYNC(); WF_VM_COUNT_TOTAL(); return (e); } while(0)
+#if WF_UNSAFE
+# define WF_VM_REQUIRE(n)
+# define WF_VM_REQUIRE_ROOM()
+# define WF_VM_CHECK(e) (void) (e)
+# define WF_VM_CHECKF(e, ...) (void) (e)
+#else
+// Check that the data stack holds at least n values, or has room for one more. These come first in
+// an instruction, so that bounded code can skip them
+# define WF_VM_REQUIRE(n) if(lsi < (n)) { WF_VM_RETURN(E_STACK_UNDERFLOW); }
+# define WF_VM_REQUIRE_ROOM() if(lsi == stack_size) { WF_VM_RETURN(E_STACK_OVERFLOW); }
+// Check for an error that can only happen if code is invalid
+# define WF_VM_CHECK(e) do { woof::Error err = e; if(err != E_OK) { WF_VM_RETURN(err); }} while(0)
+# define WF_VM_CHECKF(e, ...) do { woof::Error err = e; if(err != E_OK) { WF_VM_RETURN(errorf(err, __VA_ARGS__)); }} while(0)
+#endif
+#if WF_VM_BOUNDS
+# define WF_VM_BOUNDED (dispatch != dispatch_table)
+# define WF_VM_SET_BOUNDED(b) dispatch = (b) ? bounded_dispatch : checked_dispatch;
+// Where bounded code enters an instruction, past its stack checks
+# define WF_VM_BOUNDED_CASE(label) LABEL_BOUNDED_##label:
+// Bounded code only calls words whose stack use it accounted for, other code checks it on entry
+# define WF_VM_BOUND(label) if(!WF_VM_BOUNDED) { WF_VM_SET_BOUNDED(verified && verify_bound((ptrdiff_t) (label), lsi)); }
+// Notice a C word changing the stack other than it declared, which the callers' stack use didn't
+// account for
+# define WF_VM_VERIFY_EFFECT(before) if(dispatch == bounded_table && !verify_cword_held(code[ip-1], (ptrdiff_t) lsi - (ptrdiff_t) (before))) { \
+            WF_VM_SET_BOUNDED(false); \
+            verify_unbound(); \
+          }
+#else
+# define WF_VM_BOUNDED false
+# define WF_VM_SET_BOUNDED(b)
+# define WF_VM_BOUNDED_CASE(label)
+# define WF_VM_BOUND(label)
+# define WF_VM_VERIFY_EFFECT(before) (void) (before);
+#endif
+#if WF_VERIFY
+# define WF_VM_VERIFIED verified
+// Calls from verified code can only go to verified words, calls from other code may enter one
+# define WF_VM_VERIFY_ENTER(label) verified = verified || verify_entry((ptrdiff_t) (label)); WF_VM_BOUND(label)
+# define WF_VM_VERIFY_CALL() rstack[ri].verified = verified; rstack[ri].bounded = WF_VM_BOUNDED;
+# define WF_VM_VERIFY_RETURN() verified = rstack[ri].verified; WF_VM_SET_BOUNDED(rstack[ri].bounded)
+// Notice a C word demoting the code being run
+# define WF_VM_VERIFY_DEMOTED() if(verify_epoch != epoch) { verified = false; WF_VM_SET_BOUNDED(false) epoch = verify_epoch; }
+#else
+# define WF_VM_VERIFIED false
+# define WF_VM_VERIFY_ENTER(label)
+# define WF_VM_VERIFY_CALL()
+# define WF_VM_VERIFY_RETURN()
+# define WF_VM_VERIFY_DEMOTED()
+#endif
+// Checks that only fail for invalid code, which verified code can skip
+#define WF_VM_CHECK_CODE(e) if(!WF_VM_VERIFIED) { WF_VM_CHECK(e); }
+#define WF_VM_CHECKF_CODE(e, ...) if(!WF_VM_VERIFIED) { WF_VM_CHECKF(e, __VA_ARGS__); }
+// Replace the top two values of the stack with the result of an expression of a (second) and b (top)
+#define WF_VM_BINARY(label, exp) WF_VM_CASE(label): { \
+          WF_VM_REQUIRE(2); \
+          WF_VM_BOUNDED_CASE(label) \
+          ptrdiff_t a = WF_VM_NOS(1), b = WF_VM_TOS; \
+          WF_LOG(WF_VM, #label " @ " << (size_t)&code[ip-1] << ' ' << a << ' ' << b); \
+          lsi--; \
+          WF_VM_TOS = (exp); \
+          WF_VM_DISPATCH(); \
+        }
+    size_t lsi;
+#if WF_STACK_CACHE
+    ptrdiff_t tos;
+#endif
+    WF_VM_RELOAD();
+#if WF_COUNT_INSTRUCTIONS
+    // Counted locally so the VM loop can keep it in a register. A guard page fault loses the count
+    size_t count = 0;
+#endif
+    // Only the outermost exec suspends, code run by C words it calls runs to completion
+    bool can_suspend = suspendable;
+    suspendable = false;
+    Error suspend_error = E_YIELD;
+#if WF_PREEMPT
+    size_t budget_left = budget ? budget : SIZE_MAX;
+    budget = 0;
+#endif
+#if WF_PROFILE
+    ProfileFrame& prof = save.prof;
+#endif
+    // Resumed code is partway through a word
+    if(ip == 0) {
+      WF_VM_PROFILE_ENTER();
+    }
+#if WF_VERIFY
+    // Words are verified from their start, so resumed code runs checked until it calls one
+    bool verified = ip == 0 && verify_entry(real_to_raddr(code));
+    size_t epoch = verify_epoch;
+    WF_VM_BOUND(real_to_raddr(code));
+#endif
+    // Back up to the call of a C word that asked to be retried
+    if(can_suspend && pending_retry) {
+      pending_retry = false;
+      ip -= 2;
+    }
 
+    WF_VM_START();
     while(true) {
-      WF_VM_DISPATCH();
       WF_VM_SWITCH() {
         WF_VM_CASE(OP_PUSH_IMMEDIATE): {
+          WF_VM_REQUIRE_ROOM();
+          WF_VM_BOUNDED_CASE(OP_PUSH_IMMEDIATE)
           ptrdiff_t n = code[ip++];
           WF_LOG(WF_VM, "OP_PUSH_IMMEDIATE @ " << (size_t)&code[ip-2] << ' ' << n);
-          push(n);
+          WF_VM_PUSH(n);
           WF_VM_DISPATCH();
         }
         WF_VM_CASE(OP_CALL_FORTH): {
-          ptrdiff_t* next =  raddr_to_real((ptrdiff_t*) code[ip++]);
-          WF_LOG(WF_VM, "OP_CALL_FORTH @ " << (size_t)&code[ip-2] << ' ' << (ptrdiff_t)next << " (relative) " << code[ip-1]);
-          WF_CHECK(exec((ptrdiff_t*) code[ip-1]));
+          ptrdiff_t* label = (ptrdiff_t*) code[ip++];
+          WF_LOG(WF_VM, "OP_CALL_FORTH @ " << (size_t)&code[ip-2] << ' ' << (ptrdiff_t)raddr_to_real(label) << " (relative) " << code[ip-1]);
+          WF_VM_CHECKF_CODE(raddr_valid(label), "exec got invalid address %ld", label);
+          if(ri == rstack_size) {
+            WF_VM_RETURN(E_STACK_OVERFLOW);
+          }
+          rstack[ri].code = code;
+          rstack[ri].ip = ip;
+          rstack[ri].locals_i = locals_i;
+          WF_VM_VERIFY_CALL();
+          WF_VM_PROFILE_CALL();
+          ri++;
+          code = raddr_to_real(label);
+          ip = 0;
+          locals_i = locals.i;
+          WF_VM_VERIFY_ENTER(label);
+          WF_VM_PROFILE_ENTER();
           WF_VM_DISPATCH();
         }
         WF_VM_CASE(OP_CALL_C): {
           c_word_t cw;
-          WF_CHECK(cword_get(code[ip++], cw));
+          if(WF_VM_VERIFIED) {
+            cw = (c_word_t) cwords.data[(code[ip++] + 1) / 2];
+          } else {
+            WF_VM_CHECK(cword_get(code[ip++], cw));
+          }
           WF_LOG(WF_VM, "OP_CALL_C @ " << (size_t)&code[ip-2] << ' ' << (size_t) cw);
-          WF_CHECK(cw(*this));
+          size_t before = lsi;
+          WF_VM_SYNC();
+          guard_arm(save, false);
+          Error e = WF_VM_CALL_C(code[ip-1], cw);
+          guard_arm(save, true);
+          WF_VM_RELOAD();
+          WF_VM_VERIFY_DEMOTED();
+          if(e == E_PENDING && can_suspend) {
+            suspend_error = e;
+            goto suspend;
+          }
+          WF_VM_CHECK(e);
+          WF_VM_VERIFY_EFFECT(before);
+          WF_VM_DISPATCH();
+        }
+        WF_VM_CASE(OP_TAIL_CALL): {
+          // Replace the current word, dropping its locals but keeping its frame
+          ptrdiff_t* label = (ptrdiff_t*) code[ip++];
+          WF_LOG(WF_VM, "OP_TAIL_CALL @ " << (size_t)&code[ip-2] << ' ' << (ptrdiff_t)raddr_to_real(label) << " (relative) " << code[ip-1]);
+          WF_VM_CHECKF_CODE(raddr_valid(label), "exec got invalid address %ld", label);
+          locals.i = locals_i;
+          code = raddr_to_real(label);
+          ip = 0;
+          WF_VM_VERIFY_ENTER(label);
+          WF_VM_PROFILE_TAIL_CALL();
           WF_VM_DISPATCH();
         }
+        WF_VM_CASE(OP_NATIVE): {
+          WF_LOG(WF_VM, "OP_NATIVE @ " << (size_t)&code[ip-1] << ' ' << code[ip]);
+#if WF_JIT
+          const State* owner = jit_owner(code);
+          WF_VM_CHECK(code[ip] >= 0 && code[ip] < (ptrdiff_t) owner->jit_words_i ? E_OK : E_INVALID_OPCODE);
+          // A base's code was sealed when it finished interpreting, before anything was layered on it
+          if(owner == this && jit_rx < jit_i && !jit_seal()) {
+            WF_VM_RETURN(errorf(E_OUT_OF_MEMORY, "could not make machine code executable"));
+          }
+          WF_VM_SYNC();
+          Error e = jit_run(*owner, code[ip++]);
+          WF_VM_RELOAD();
+          if(e != E_OK) {
+            WF_VM_RETURN(e);
+          }
+          // The whole word has run, so continue on to exit from it
+#else
+          WF_VM_RETURN(E_INVALID_OPCODE);
+#endif
+        }
         WF_VM_CASE(OP_EXIT): {
           WF_LOG(WF_VM, "OP_EXIT @ " << (size_t)&code[ip-1]);
-          return E_OK;
+          locals.i = locals_i;
+          WF_VM_PROFILE_EXIT();
+          if(ri == rbase) {
+            WF_VM_RETURN(E_OK);
+          }
+          ri--;
+          code = rstack[ri].code;
+          ip = rstack[ri].ip;
+          locals_i = rstack[ri].locals_i;
+          WF_VM_VERIFY_RETURN();
+          WF_VM_PROFILE_RETURN();
+          WF_VM_DISPATCH();
         }
         WF_VM_CASE(OP_JUMP_IF_ZERO): {
-          // Check stack
-          if(si == 0) {
-            return E_STACK_UNDERFLOW;
-          }
+          WF_VM_REQUIRE(1);
+          WF_VM_BOUNDED_CASE(OP_JUMP_IF_ZERO)
           // REFACTOR getting a pointer as an raddr
           ptrdiff_t* label = (ptrdiff_t*) code[ip++];
           WF_LOG(WF_VM, "OP_JUMP_IF_ZERO @ " << (size_t)&code[ip-2] << ' ' << (size_t)label);
-          si -= 1;
-          if(stack[si].bits == 0) {
-            WF_CHECK(raddr_valid((ptrdiff_t*)label));
+          ptrdiff_t flag = WF_VM_TOS;
+          WF_VM_POP(1);
+          if(flag == 0) {
+            WF_VM_CHECK_CODE(raddr_valid((ptrdiff_t*)label));
             code = raddr_to_real(label);
             ip = 0;
           }
@@ -1268,36 +4466,903 @@ struct State {
           ptrdiff_t* label = (ptrdiff_t*) code[ip++];
           WF_LOG(WF_VM, "OP_JUMP @" << (size_t)&code[ip-1] << ' ' << label);
           ip = 0;
-          WF_CHECK(raddr_valid(label));
+          WF_VM_CHECK_CODE(raddr_valid(label));
           code = raddr_to_real(label);
           WF_VM_DISPATCH();
         }
         WF_VM_CASE(OP_LOCAL_PUSH): {
           // Push a local value onto the data stack
+          WF_VM_REQUIRE_ROOM();
+          WF_VM_BOUNDED_CASE(OP_LOCAL_PUSH)
           ptrdiff_t local = code[ip++];
           ptrdiff_t actual = locals.i - local - 1;
           WF_LOG(WF_VM, "OP_LOCAL_PUSH @" << (size_t)&code[ip-1] << ' ' << local << " (actual " << actual << ")")
-
-          WF_CHECK(push(locals.data[actual]));
+          WF_VM_CHECK_CODE(local >= 0 && (size_t) local < locals.i - locals_i ? E_OK : E_OUT_OF_RANGE);
+          WF_VM_PUSH(locals.data[actual]);
           WF_VM_DISPATCH();
         }
         WF_VM_CASE(OP_LOCAL_SET): {
+          if(lsi == 0) {
+            WF_VM_RETURN(E_STACK_UNDERFLOW);
+          }
+          WF_VM_BOUNDED_CASE(OP_LOCAL_SET)
           WF_LOG(WF_VM, "OP_LOCAL_SET");
-          // REFACTOR normal pointer
-          Cell val;
-          WF_CHECK(pop(val));
+          ptrdiff_t val = WF_VM_TOS;
+          WF_VM_POP(1);
 
-          WF_CHECK(locals.push(val.bits));
+          Error e = locals.push(val);
+          if(e != E_OK) {
+            WF_VM_RETURN(e);
+          }
+          WF_VM_DISPATCH();
+        }
+#if WF_VM_BOUNDS
+        LABEL_GUARDED_OP_LOCAL_SET: {
+          WF_LOG(WF_VM, "OP_LOCAL_SET");
+          ptrdiff_t val = WF_VM_TOS;
+          WF_VM_POP(1);
+          locals.data[locals.i++] = val;
+          WF_VM_DISPATCH();
+        }
+#endif
+        WF_VM_BINARY(OP_ADD, a + b)
+        WF_VM_BINARY(OP_SUB, a - b)
+        WF_VM_BINARY(OP_MUL, a * b)
+        WF_VM_BINARY(OP_GT, a > b ? -1 : 0)
+        WF_VM_BINARY(OP_EQ, a == b)
+        WF_VM_CASE(OP_MOD): {
+          WF_VM_REQUIRE(2);
+          WF_VM_BOUNDED_CASE(OP_MOD)
+          WF_LOG(WF_VM, "OP_MOD @ " << (size_t)&code[ip-1]);
+          ptrdiff_t a = WF_VM_NOS(1), b = WF_VM_TOS;
+          if(b == 0) {
+            WF_VM_RETURN(E_DIVIDE_BY_ZERO);
+          }
+          lsi--;
+          WF_VM_TOS = a % b;
+          WF_VM_DISPATCH();
+        }
+        WF_VM_CASE(OP_DUP): {
+          WF_VM_REQUIRE(1);
+          WF_VM_REQUIRE_ROOM();
+          WF_VM_BOUNDED_CASE(OP_DUP)
+          WF_LOG(WF_VM, "OP_DUP @ " << (size_t)&code[ip-1]);
+          WF_VM_PUSH(WF_VM_TOS);
+          WF_VM_DISPATCH();
+        }
+        WF_VM_CASE(OP_DROP): {
+          WF_VM_REQUIRE(1);
+          WF_VM_BOUNDED_CASE(OP_DROP)
+          WF_LOG(WF_VM, "OP_DROP @ " << (size_t)&code[ip-1]);
+          WF_VM_POP(1);
+          WF_VM_DISPATCH();
+        }
+        WF_VM_CASE(OP_SWAP): {
+          WF_VM_REQUIRE(2);
+          WF_VM_BOUNDED_CASE(OP_SWAP)
+          WF_LOG(WF_VM, "OP_SWAP @ " << (size_t)&code[ip-1]);
+          ptrdiff_t top = WF_VM_TOS;
+          WF_VM_TOS = WF_VM_NOS(1);
+          WF_VM_NOS(1) = top;
+          WF_VM_DISPATCH();
+        }
+        WF_VM_CASE(OP_FETCH): {
+          WF_VM_REQUIRE(1);
+          WF_VM_BOUNDED_CASE(OP_FETCH)
+          ptrdiff_t* raddr = (ptrdiff_t*) WF_VM_TOS;
+          WF_LOG(WF_VM, "OP_FETCH @ " << (size_t)&code[ip-1] << ' ' << (ptrdiff_t)raddr);
+          WF_VM_CHECK(raddr_valid(raddr));
+          WF_VM_TOS = *raddr_to_real(raddr);
+          WF_VM_DISPATCH();
+        }
+        WF_VM_CASE(OP_STORE): {
+          WF_VM_REQUIRE(2);
+          WF_VM_BOUNDED_CASE(OP_STORE)
+          ptrdiff_t* raddr = (ptrdiff_t*) WF_VM_TOS;
+          WF_LOG(WF_VM, "OP_STORE @ " << (size_t)&code[ip-1] << ' ' << (ptrdiff_t)raddr);
+          WF_VM_CHECK(raddr_writable(raddr));
+#if WF_VERIFY
+          if((size_t) raddr < verify_end && verify_store((ptrdiff_t) raddr)) {
+            verified = false;
+            WF_VM_SET_BOUNDED(false)
+          }
+#endif
+          *raddr_to_real(raddr) = WF_VM_NOS(1);
+          WF_VM_POP(2);
           WF_VM_DISPATCH();
         }
+        WF_VM_DEFAULT()
         WF_VM_CASE(OP_UNKNOWN): {
           WF_LOG(WF_VM, "E_INVALID_OPCODE @ " << (size_t)&code[ip-1] << ' ' << code[ip-1]);
-          return E_INVALID_OPCODE;
+          WF_VM_RETURN(E_INVALID_OPCODE);
         }
       }
     }
     return E_OK;
+  suspend:
+#if WF_VERIFY
+    // The stack can change before resume, so callers' stack use has to be checked again
+    verify_unbound();
+#endif
+    // Leave frames and locals for resume
+    suspended.code = code;
+    suspended.ip = ip;
+    suspended.locals_i = locals_i;
+    suspended_rbase = rbase;
+    save.fs.unwind = false;
+    WF_VM_RETURN(suspend_error);
+  }
+
+#if WF_JIT
+  /***** JIT COMPILER */
+
+  /**
+   * A word compiled to machine code. The first two cells of its bytecode are replaced with
+   * OP_NATIVE and its index, so the interpreter enters the machine code whenever it is called
+   */
+  struct JitWord {
+    /** Relative address of the bytecode */
+    ptrdiff_t code;
+    /** The bytecode cells replaced by OP_NATIVE */
+    ptrdiff_t saved[2];
+    /** Entry point of the machine code */
+    unsigned char* native;
+    /** Offset of the start of the machine code in jit_memory */
+    size_t start;
+  };
+
+  /** Executable memory, mapped on first use */
+  unsigned char* jit_memory;
+  size_t jit_i, jit_words_i;
+  /**
+   * Table of compiled words, indexed by the operand of OP_NATIVE. Kept apart from jit_memory so its
+   * protection never changes
+   */
+  JitWord* jit_table;
+  size_t jit_table_size;
+  /**
+   * End of the pages of jit_memory that are executable. Pages past it are writable, so compiling a
+   * word only changes the protection of the page its code starts in, and only if code there has
+   * been sealed since. See jit_seal
+   */
+  size_t jit_rx, jit_page;
+
+  /** Machine code that loads registers from State and calls a compiled word */
+  unsigned char* jit_enter;
+
+  /**
+   * Lowest native stack address compiled words may use. Machine code calls each other natively,
+   * so this takes the place of the return stack's bounds check
+   */
+  char* jit_stack_limit;
+
+  JitWord* jit_words() const {
+    return jit_table;
+  }
+
+  /**
+   * Make the machine code compiled so far executable, and no longer writable. Done lazily, when
+   * compiled code is about to run or interpretation finishes, so that defining many words in a
+   * row costs two calls to mprotect rather than two per word
+   */
+  bool jit_seal() {
+    if(jit_rx >= jit_i) {
+      return true;
+    }
+    size_t to = align(jit_page, jit_i);
+    if(mprotect(&jit_memory[jit_rx], to - jit_rx, PROT_READ | PROT_EXEC) != 0) {
+      return false;
+    }
+    jit_rx = to;
+    return true;
+  }
+
+  /** Make room in the table for one more compiled word, doubling its size */
+  bool jit_table_reserve() {
+    if(jit_words_i < jit_table_size) {
+      return true;
+    }
+    size_t size = jit_table_size * 2;
+    void* m = mmap(0, size * sizeof(JitWord), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED) {
+      return false;
+    }
+    memcpy(m, jit_table, jit_words_i * sizeof(JitWord));
+    munmap(jit_table, jit_table_size * sizeof(JitWord));
+    jit_table = (JitWord*) m;
+    jit_table_size = size;
+    return true;
+  }
+
+  /** The State that compiled code, which is the base for words in the base dictionary */
+  const State* jit_owner(const ptrdiff_t* code) const {
+    return in_base(code) ? base : this;
+  }
+
+  /** If code belongs to a compiled word, return its entry in the owner's table */
+  const JitWord* jit_lookup(const ptrdiff_t* code) const {
+    const State* owner = jit_owner(code);
+    if(code[0] != OP_NATIVE || code[1] < 0 || code[1] >= (ptrdiff_t) owner->jit_words_i) {
+      return 0;
+    }
+    return &owner->jit_words()[code[1]];
+  }
+
+  /** If code belongs to a compiled word, return the bytecode cells replaced by OP_NATIVE */
+  const ptrdiff_t* jit_saved(const ptrdiff_t* code) const {
+    const JitWord* w = jit_lookup(code);
+    return w ? w->saved : 0;
+  }
+
+  /** Run a word compiled by owner, which is this State or its base */
+  Error jit_run(const State& owner, ptrdiff_t idx) {
+    return ((Error (*)(State*, unsigned char*)) owner.jit_enter)(this, owner.jit_words()[idx].native);
+  }
+
+  /** Called from machine code for Forth words that were not compiled */
+  static Error jit_call_forth(State* s, ptrdiff_t code) {
+    return s->exec((ptrdiff_t*) code);
+  }
+
+  /** Called from machine code for C words, which guard page faults mustn't jump out of */
+  static Error jit_call_c(State* s, ptrdiff_t cw) {
+    GuardJump* g = guard_current();
+    sig_atomic_t armed = g ? g->armed : 0;
+    if(g) {
+      g->armed = 0;
+    }
+    Error e = ((c_word_t) cw)(*s);
+    if(g) {
+      g->armed = armed;
+    }
+    return e;
+  }
+
+#if WF_VERIFY
+  /** Called from machine code for stores that may overwrite verified code */
+  static Error jit_verify_store(State* s, ptrdiff_t a) {
+    s->verify_store(a);
+    return E_OK;
+  }
+#endif
+
+  // Machine code register assignments: rbx holds State, r12 the base of the data stack, r13 the
+  // address of the next free cell on the data stack and r14 the end of the data stack. Each
+  // compiled word pushes one cell onto the native stack, holding the locals index at entry for
+  // words that use locals
+  enum { JIT_STATE = Assembler::RBX, JIT_BASE = Assembler::R12, JIT_SP = Assembler::R13, JIT_LIMIT = Assembler::R14 };
+
+  /** Native stack used by each call between compiled words */
+  enum { JIT_FRAME_SIZE = 2 * sizeof(ptrdiff_t) };
+
+  /** Write the stack pointer back to si */
+  void jit_store_si(Assembler& a, int reg) {
+    a.reg(0x89, reg, JIT_SP);
+    a.reg(0x29, reg, JIT_BASE);
+    a.reg(0xc1, reg, 7); a.byte(3);
+    a.mem(0x89, reg, JIT_STATE, offsetof(State, si));
+  }
+
+  /** Reload the stack pointer from si */
+  void jit_load_si(Assembler& a) {
+    a.mem(0x8b, Assembler::RAX, JIT_STATE, offsetof(State, si));
+    a.mem_index(0x8d, JIT_SP, JIT_BASE, Assembler::RAX, 3, 0);
   }
+
+  /** Move the data stack pointer by n cells */
+  void jit_move_sp(Assembler& a, ptrdiff_t n) {
+    a.reg(0x81, JIT_SP, n > 0 ? 0 : 5);
+    a.u32((n > 0 ? n : -n) * sizeof(Cell));
+  }
+
+  /**
+   * Jump to label if the data stack holds less than n values, unless an earlier check already
+   * covers it. known is the depth already checked
+   */
+  void jit_require(Assembler& a, size_t n, size_t& known, size_t label) {
+    if(known >= n) {
+      return;
+    }
+#if !WF_UNSAFE
+    a.mem(0x8d, Assembler::RAX, JIT_BASE, n * sizeof(Cell));
+    a.reg(0x39, JIT_SP, Assembler::RAX);
+    a.rel32(0x0f82, label);
+#endif
+    known = n;
+  }
+
+  /** Jump to label if the data stack has no room for another value, unless checked on entry */
+  void jit_require_room(Assembler& a, bool checked, size_t label) {
+#if !WF_UNSAFE
+    if(!checked) {
+      a.reg(0x39, JIT_SP, JIT_LIMIT);
+      a.rel32(0x0f83, label);
+    }
+#else
+    (void) a; (void) checked; (void) label;
+#endif
+  }
+
+  /** Return from a compiled word if a call returned an error */
+  void jit_check(Assembler& a, size_t error_exit) {
+    a.byte(0x85); a.byte(0xc0);
+    a.rel32(0x0f85, error_exit);
+  }
+
+  /** Restore locals to what they were on entry */
+  void jit_restore_locals(Assembler& a) {
+    a.mem(0x8b, Assembler::RAX, Assembler::RSP, 0);
+    a.mem(0x89, Assembler::RAX, JIT_STATE, offsetof(State, locals) + offsetof(Stack, i));
+  }
+
+  /** Pop this word's native stack cell, restoring locals if needed */
+  void jit_leave(Assembler& a, bool uses_locals) {
+    if(uses_locals) {
+      a.byte(0x58);
+      a.mem(0x89, Assembler::RAX, JIT_STATE, offsetof(State, locals) + offsetof(Stack, i));
+    } else {
+      a.byte(0x59);
+    }
+  }
+
+  /** Call a C function with State as its first argument, syncing si around the call */
+  void jit_call(Assembler& a, const void* fn, bool code_arg, ptrdiff_t code, size_t error_exit) {
+    jit_store_si(a, Assembler::RAX);
+    a.reg(0x89, Assembler::RDI, JIT_STATE);
+    if(code_arg) {
+      a.mov_imm(Assembler::RSI, code);
+    }
+    a.mov_imm(Assembler::RAX, (uint64_t) fn);
+    a.byte(0xff); a.byte(0xd0);
+    jit_check(a, error_exit);
+    jit_load_si(a);
+  }
+
+  /** Emit a stub that returns an error code */
+  size_t jit_error_stub(Assembler& a, Error e, size_t error_exit) {
+    size_t at = a.i;
+    a.byte(0xb8); a.u32(e);
+    a.rel32(0xe9, error_exit);
+    return at;
+  }
+
+  /**
+   * Map memory for machine code and the table of compiled words, and emit jit_enter. It is left
+   * writable, and only made executable once jit_word is done writing to it
+   */
+  bool jit_init() {
+    void* m = mmap(0, WF_JIT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED) {
+      return false;
+    }
+    void* t = mmap(0, WF_JIT_WORDS * sizeof(JitWord), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(t == MAP_FAILED) {
+      munmap(m, WF_JIT_SIZE);
+      return false;
+    }
+    jit_memory = (unsigned char*) m;
+    jit_table = (JitWord*) t;
+    jit_table_size = WF_JIT_WORDS;
+    jit_page = sysconf(_SC_PAGESIZE);
+    jit_i = 0;
+    jit_rx = 0;
+
+    Assembler a(&jit_memory[jit_i], 256);
+    // push rbx, r12, r13, r14, r15
+    a.byte(0x53); a.byte(0x41); a.byte(0x54); a.byte(0x41); a.byte(0x55); a.byte(0x41); a.byte(0x56);
+    a.byte(0x41); a.byte(0x57);
+    a.reg(0x89, JIT_STATE, Assembler::RDI);
+    // Save the stack limit of any compiled code we were called from, keeping the stack aligned
+    a.mem(0xff, 6, JIT_STATE, offsetof(State, jit_stack_limit));
+    a.reg(0x81, Assembler::RSP, 5); a.u32(8);
+    // Allow as many nested calls as the return stack has room for
+    a.mem(0x8b, Assembler::RAX, JIT_STATE, offsetof(State, rstack_size));
+    a.mem(0x2b, Assembler::RAX, JIT_STATE, offsetof(State, ri));
+    a.reg(0xc1, Assembler::RAX, 4); a.byte(4);
+    a.reg(0x89, Assembler::RCX, Assembler::RSP);
+    a.reg(0x29, Assembler::RCX, Assembler::RAX);
+    a.mem(0x89, Assembler::RCX, JIT_STATE, offsetof(State, jit_stack_limit));
+    a.mem(0x8b, JIT_BASE, JIT_STATE, offsetof(State, stack));
+    a.mem(0x8b, Assembler::RAX, JIT_STATE, offsetof(State, stack_size));
+    a.mem_index(0x8d, JIT_LIMIT, JIT_BASE, Assembler::RAX, 3, 0);
+    jit_load_si(a);
+    // call rsi
+    a.byte(0xff); a.byte(0xd6);
+    jit_store_si(a, Assembler::RCX);
+    a.reg(0x81, Assembler::RSP, 0); a.u32(8);
+    a.mem(0x8f, 0, JIT_STATE, offsetof(State, jit_stack_limit));
+    // pop r15, r14, r13, r12, rbx
+    a.byte(0x41); a.byte(0x5f); a.byte(0x41); a.byte(0x5e); a.byte(0x41); a.byte(0x5d); a.byte(0x41);
+    a.byte(0x5c); a.byte(0x5b);
+    a.byte(0xc3);
+    WF_ASSERT(!a.overflow);
+
+    jit_enter = &jit_memory[jit_i];
+    jit_i = align(16, jit_i + a.i);
+    return true;
+  }
+
+  /**
+   * Decode the instruction at code[c] of a word with the given number of cells. Returns the
+   * index of the next instruction or 0 if the instruction is truncated
+   */
+  static size_t jit_decode(const ptrdiff_t* code, size_t c, size_t cells, ptrdiff_t& op, ptrdiff_t& operand) {
+    op = code[c];
+    switch(op) {
+      case OP_PUSH_IMMEDIATE: case OP_CALL_FORTH: case OP_CALL_C: case OP_JUMP_IF_ZERO:
+      case OP_JUMP: case OP_JUMP_IGNORED: case OP_LOCAL_PUSH: case OP_TAIL_CALL:
+        if(c + 1 >= cells) {
+          return 0;
+        }
+        operand = code[c + 1];
+        return c + 2;
+      default:
+        operand = 0;
+        return c + 1;
+    }
+  }
+
+  /**
+   * Compile the word whose bytecode spans memory[start_i..end_i) to machine code. Words with
+   * jumps that leave their own code, or anything else not understood, are left to the interpreter
+   */
+  bool jit_word(size_t start_i, size_t end_i) {
+#if WF_PREEMPT
+    // Machine code runs to completion, which would get around the instruction budget
+    (void) start_i; (void) end_i;
+    return false;
+#else
+    // Machine code memory is never writable and executable at once. Only the page the new code
+    // starts in, or pages freed by forget, need to be made writable again
+    if(!jit_memory && !jit_init()) {
+      return false;
+    }
+    size_t from = jit_i / jit_page * jit_page;
+    if(from < jit_rx) {
+      if(mprotect(&jit_memory[from], jit_rx - from, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+      }
+      jit_rx = from;
+    }
+    if(!jit_emit(start_i, end_i)) {
+      return false;
+    }
+    // The machine code is made executable by jit_seal before OP_NATIVE first enters it
+    ptrdiff_t* code = (ptrdiff_t*) &memory[start_i];
+    code[0] = OP_NATIVE;
+    code[1] = jit_words_i - 1;
+    return true;
+#endif
+  }
+
+  /**
+   * Emit machine code for jit_word, with jit_memory from jit_i on writable. The bytecode is left as
+   * it is
+   */
+  bool jit_emit(size_t start_i, size_t end_i) {
+    size_t cells = (end_i - start_i) / sizeof(ptrdiff_t);
+    if(cells < 2 || !jit_table_reserve()) {
+      return false;
+    }
+
+    ptrdiff_t* code = (ptrdiff_t*) &memory[start_i];
+
+    // Scratch space maps bytecode cells to machine code offsets, and records jumps to patch once
+    // those are known
+    const uint32_t NONE = (uint32_t) -1, TARGET = (uint32_t) -2;
+    uint32_t* offsets = work_reserve(cells * 3);
+    if(!offsets) {
+      return false;
+    }
+    uint32_t* fixups = &offsets[cells];
+    size_t fixups_i = 0;
+    for(size_t c = 0; c != cells; c++) {
+      offsets[c] = NONE;
+    }
+
+    // Find jump targets, check they are instructions within this word and whether locals are used
+    bool uses_locals = false;
+    for(size_t c = 0; c < cells;) {
+      ptrdiff_t op, operand;
+      size_t next = jit_decode(code, c, cells, op, operand);
+      if(next == 0) {
+        return false;
+      }
+      if(op == OP_JUMP_IF_ZERO || op == OP_JUMP || op == OP_JUMP_IGNORED) {
+        if(operand < (ptrdiff_t) start_i || operand >= (ptrdiff_t) end_i || (operand - start_i) % sizeof(ptrdiff_t)) {
+          return false;
+        }
+        size_t target = (operand - start_i) / sizeof(ptrdiff_t);
+        if(op == OP_JUMP_IGNORED) {
+          // Skip whatever data is being jumped over
+          if(target < next) {
+            return false;
+          }
+          next = target;
+        }
+        offsets[target] = TARGET;
+      }
+      if(op == OP_LOCAL_SET || op == OP_LOCAL_PUSH) {
+        uses_locals = true;
+      }
+      c = next;
+    }
+
+    Assembler a(&jit_memory[jit_i], WF_JIT_SIZE - jit_i);
+
+    // Error stubs come first so that jumps to them are backwards
+    size_t overflow = a.i;
+    a.byte(0xb8); a.u32(E_STACK_OVERFLOW);
+    a.byte(0xc3);
+    size_t error_exit = a.i;
+    a.byte(0x59); a.byte(0xc3);
+    size_t underflow = jit_error_stub(a, E_STACK_UNDERFLOW, error_exit);
+    size_t invalid_address = jit_error_stub(a, E_INVALID_ADDRESS, error_exit);
+    size_t divide_by_zero = jit_error_stub(a, E_DIVIDE_BY_ZERO, error_exit);
+    size_t out_of_memory = jit_error_stub(a, E_OUT_OF_MEMORY, error_exit);
+#if !WF_UNSAFE
+    size_t out_of_range = jit_error_stub(a, E_OUT_OF_RANGE, error_exit);
+#endif
+    size_t stack_overflow = jit_error_stub(a, E_STACK_OVERFLOW, error_exit);
+
+    // Prologue: check native stack depth and push the locals index, aligning the stack for calls
+    size_t entry = a.i;
+    a.mem(0x3b, Assembler::RSP, JIT_STATE, offsetof(State, jit_stack_limit));
+    a.rel32(0x0f82, overflow);
+    if(uses_locals) {
+      a.mem(0xff, 6, JIT_STATE, offsetof(State, locals) + offsetof(Stack, i));
+    } else {
+      a.byte(0x50);
+    }
+    size_t body = a.i;
+    // Whether the data stack was checked for room for every push, here. Otherwise each push checks
+    bool room = false;
+#if WF_VERIFY
+    // Words with a known stack effect check once, on entry and on each tail call to themselves
+    StackEffect effect;
+    if(verify_effect(start_i, effect)) {
+      room = true;
+      if(effect.peak > effect.in) {
+        a.mem(0x8d, Assembler::RAX, JIT_SP, (effect.peak - effect.in) * sizeof(Cell));
+        a.reg(0x39, Assembler::RAX, JIT_LIMIT);
+        a.rel32(0x0f87, stack_overflow);
+      }
+    }
+#endif
+
+    const int32_t locals_i = offsetof(State, locals) + offsetof(Stack, i);
+    const int32_t locals_data = offsetof(State, locals) + offsetof(Stack, data);
+    const int32_t locals_size = offsetof(State, locals) + offsetof(Stack, size);
+
+    // Data stack depth verified by underflow checks so far
+    size_t known = 0;
+
+    size_t c = 0;
+    while(c < cells) {
+      ptrdiff_t op, operand;
+      size_t next = jit_decode(code, c, cells, op, operand);
+
+      if(offsets[c] == TARGET) {
+        known = 0;
+      }
+      offsets[c] = a.i;
+
+      // Look ahead for an immediate or comparison that can be combined with the following
+      // instructions, as long as nothing jumps between them
+      ptrdiff_t op2 = OP_UNKNOWN, op3 = OP_UNKNOWN, operand2 = 0, operand3 = 0;
+      size_t next2 = next, next3 = next;
+      if(next < cells && offsets[next] != TARGET) {
+        next2 = jit_decode(code, next, cells, op2, operand2);
+        if(next2 == 0) {
+          return false;
+        }
+        if(next2 < cells && offsets[next2] != TARGET) {
+          next3 = jit_decode(code, next2, cells, op3, operand3);
+          if(next3 == 0) {
+            return false;
+          }
+        }
+      }
+      bool imm32 = operand == (int32_t) operand;
+
+      // Calls to this word or other compiled words are made directly
+      unsigned char* native = 0;
+      if(op == OP_CALL_FORTH || op == OP_TAIL_CALL) {
+        if(operand == (ptrdiff_t) start_i) {
+          native = &jit_memory[jit_i + entry];
+        } else if(operand >= 0 && operand + sizeof(ptrdiff_t) < memory_i) {
+          const JitWord* callee = jit_lookup(raddr_to_real((ptrdiff_t*) operand));
+          if(callee) {
+            native = callee->native;
+          }
+        }
+      }
+
+      size_t target = 0;
+      if(op == OP_JUMP_IF_ZERO || op == OP_JUMP || op == OP_JUMP_IGNORED) {
+        target = (operand - start_i) / sizeof(ptrdiff_t);
+      }
+
+      if(op == OP_PUSH_IMMEDIATE && imm32 && (op2 == OP_GT || op2 == OP_EQ) && op3 == OP_JUMP_IF_ZERO) {
+        // n > if, n = if
+        jit_require(a, 1, known, underflow);
+        jit_move_sp(a, -1);
+        a.mem(0x81, 7, JIT_SP, 0); a.u32(operand);
+        fixups[fixups_i++] = a.rel32(op2 == OP_GT ? 0x0f8e : 0x0f85, 0);
+        fixups[fixups_i++] = (operand3 - start_i) / sizeof(ptrdiff_t);
+        known -= 1;
+        offsets[next] = offsets[next2] = a.i;
+        c = next3;
+        continue;
+      }
+
+      if(op == OP_PUSH_IMMEDIATE && imm32 && (op2 == OP_ADD || op2 == OP_SUB)) {
+        // n + and n -
+        jit_require(a, 1, known, underflow);
+        a.mem(0x81, op2 == OP_ADD ? 0 : 5, JIT_SP, -8); a.u32(operand);
+        offsets[next] = a.i;
+        c = next2;
+        continue;
+      }
+
+      if((op == OP_GT || op == OP_EQ) && op2 == OP_JUMP_IF_ZERO) {
+        // > if, = if
+        jit_require(a, 2, known, underflow);
+        jit_move_sp(a, -2);
+        a.mem(0x8b, Assembler::RAX, JIT_SP, 0);
+        a.mem(0x3b, Assembler::RAX, JIT_SP, 8);
+        fixups[fixups_i++] = a.rel32(op == OP_GT ? 0x0f8e : 0x0f85, 0);
+        fixups[fixups_i++] = (operand2 - start_i) / sizeof(ptrdiff_t);
+        known -= 2;
+        offsets[next] = a.i;
+        c = next2;
+        continue;
+      }
+
+      switch(op) {
+        case OP_PUSH_IMMEDIATE:
+          jit_require_room(a, room, stack_overflow);
+          if(imm32) {
+            a.mem(0xc7, 0, JIT_SP, 0); a.u32(operand);
+          } else {
+            a.mov_imm(Assembler::RAX, operand);
+            a.mem(0x89, Assembler::RAX, JIT_SP, 0);
+          }
+          jit_move_sp(a, 1);
+          known++;
+          break;
+        case OP_CALL_FORTH:
+          if(native) {
+            a.rel32(0xe8, native - a.code);
+            jit_check(a, error_exit);
+          } else {
+            jit_call(a, (const void*) &jit_call_forth, true, operand, error_exit);
+          }
+          known = 0;
+          break;
+        case OP_TAIL_CALL:
+          if(native) {
+            if(uses_locals) {
+              jit_restore_locals(a);
+            }
+            if(operand == (ptrdiff_t) start_i) {
+              a.rel32(0xe9, body);
+            } else {
+              // Leave this frame and let the callee return to our caller
+              a.byte(0x59);
+              a.rel32(0xe9, native - a.code);
+            }
+          } else {
+            jit_call(a, (const void*) &jit_call_forth, true, operand, error_exit);
+            jit_leave(a, uses_locals);
+            a.byte(0x31); a.byte(0xc0);
+            a.byte(0xc3);
+          }
+          known = 0;
+          break;
+        case OP_CALL_C: {
+          c_word_t cw;
+          if(cword_get(operand, cw) != E_OK) {
+            return false;
+          }
+          jit_call(a, (const void*) &jit_call_c, true, (ptrdiff_t) cw, error_exit);
+          known = 0;
+          break;
+        }
+        case OP_JUMP_IF_ZERO:
+          jit_require(a, 1, known, underflow);
+          jit_move_sp(a, -1);
+          a.mem(0x83, 7, JIT_SP, 0); a.byte(0);
+          fixups[fixups_i++] = a.rel32(0x0f84, 0);
+          fixups[fixups_i++] = target;
+          known -= 1;
+          break;
+        case OP_JUMP_IGNORED:
+          next = target;
+          // Anything else may jump into the rest of the code, so treat it like a target
+          // fall through
+        case OP_JUMP:
+          fixups[fixups_i++] = a.rel32(0xe9, 0);
+          fixups[fixups_i++] = target;
+          known = 0;
+          break;
+        case OP_LOCAL_PUSH:
+          if(operand < 0 || operand != (int32_t) operand) {
+            return false;
+          }
+          jit_require_room(a, room, stack_overflow);
+          a.mem(0x8b, Assembler::RAX, JIT_STATE, locals_i);
+#if !WF_UNSAFE
+          // The local must be one of this word's, which start at the locals index saved on entry
+          a.reg(0x89, Assembler::RCX, Assembler::RAX);
+          a.mem(0x2b, Assembler::RCX, Assembler::RSP, 0);
+          a.reg(0x81, Assembler::RCX, 7); a.u32(operand);
+          a.rel32(0x0f86, out_of_range);
+#endif
+          a.mem(0x8b, Assembler::RCX, JIT_STATE, locals_data);
+          a.mem_index(0x8b, Assembler::RAX, Assembler::RCX, Assembler::RAX, 3, -(operand + 1) * sizeof(ptrdiff_t));
+          a.mem(0x89, Assembler::RAX, JIT_SP, 0);
+          jit_move_sp(a, 1);
+          known++;
+          break;
+        case OP_LOCAL_SET:
+          jit_require(a, 1, known, underflow);
+          a.mem(0x8b, Assembler::RAX, JIT_STATE, locals_i);
+          a.mem(0x3b, Assembler::RAX, JIT_STATE, locals_size);
+          a.rel32(0x0f83, out_of_memory);
+          a.mem(0x8b, Assembler::RCX, JIT_STATE, locals_data);
+          jit_move_sp(a, -1);
+          a.mem(0x8b, Assembler::RDX, JIT_SP, 0);
+          a.mem_index(0x89, Assembler::RDX, Assembler::RCX, Assembler::RAX, 3, 0);
+          a.reg(0xff, Assembler::RAX, 0);
+          a.mem(0x89, Assembler::RAX, JIT_STATE, locals_i);
+          known -= 1;
+          break;
+        case OP_EXIT:
+          jit_leave(a, uses_locals);
+          a.byte(0x31); a.byte(0xc0);
+          a.byte(0xc3);
+          known = 0;
+          break;
+        case OP_ADD: case OP_SUB:
+          jit_require(a, 2, known, underflow);
+          a.mem(0x8b, Assembler::RAX, JIT_SP, -8);
+          a.mem(op == OP_ADD ? 0x01 : 0x29, Assembler::RAX, JIT_SP, -16);
+          jit_move_sp(a, -1);
+          known -= 1;
+          break;
+        case OP_MUL:
+          jit_require(a, 2, known, underflow);
+          a.mem(0x8b, Assembler::RAX, JIT_SP, -16);
+          a.mem(0x0faf, Assembler::RAX, JIT_SP, -8);
+          a.mem(0x89, Assembler::RAX, JIT_SP, -16);
+          jit_move_sp(a, -1);
+          known -= 1;
+          break;
+        case OP_GT: case OP_EQ:
+          jit_require(a, 2, known, underflow);
+          a.mem(0x8b, Assembler::RAX, JIT_SP, -16);
+          a.mem(0x3b, Assembler::RAX, JIT_SP, -8);
+          // setg/sete al, movzx eax, al
+          a.byte(0x0f); a.byte(op == OP_GT ? 0x9f : 0x94); a.byte(0xc0);
+          a.byte(0x0f); a.byte(0xb6); a.byte(0xc0);
+          if(op == OP_GT) {
+            a.reg(0xf7, Assembler::RAX, 3);
+          }
+          a.mem(0x89, Assembler::RAX, JIT_SP, -16);
+          jit_move_sp(a, -1);
+          known -= 1;
+          break;
+        case OP_MOD:
+          jit_require(a, 2, known, underflow);
+          a.mem(0x8b, Assembler::RCX, JIT_SP, -8);
+          a.reg(0x85, Assembler::RCX, Assembler::RCX);
+          a.rel32(0x0f84, divide_by_zero);
+          a.mem(0x8b, Assembler::RAX, JIT_SP, -16);
+          // cqo, idiv rcx
+          a.byte(0x48); a.byte(0x99);
+          a.reg(0xf7, Assembler::RCX, 7);
+          a.mem(0x89, Assembler::RDX, JIT_SP, -16);
+          jit_move_sp(a, -1);
+          known -= 1;
+          break;
+        case OP_DUP:
+          jit_require(a, 1, known, underflow);
+          jit_require_room(a, room, stack_overflow);
+          a.mem(0x8b, Assembler::RAX, JIT_SP, -8);
+          a.mem(0x89, Assembler::RAX, JIT_SP, 0);
+          jit_move_sp(a, 1);
+          known++;
+          break;
+        case OP_DROP:
+          jit_require(a, 1, known, underflow);
+          jit_move_sp(a, -1);
+          known -= 1;
+          break;
+        case OP_SWAP:
+          jit_require(a, 2, known, underflow);
+          a.mem(0x8b, Assembler::RAX, JIT_SP, -8);
+          a.mem(0x8b, Assembler::RCX, JIT_SP, -16);
+          a.mem(0x89, Assembler::RAX, JIT_SP, -16);
+          a.mem(0x89, Assembler::RCX, JIT_SP, -8);
+          break;
+        case OP_FETCH: case OP_STORE:
+          jit_require(a, op == OP_FETCH ? 1 : 2, known, underflow);
+          a.mem(0x8b, Assembler::RAX, JIT_SP, -8);
+#if !WF_UNSAFE
+          {
+            // Unsigned comparison also catches negative addresses. Past the dictionary, the
+            // address may be in the heap
+            a.mem(0x3b, Assembler::RAX, JIT_STATE, offsetof(State, memory_i));
+            size_t in_memory = a.rel32(0x0f86, 0);
+            a.reg(0x89, Assembler::RDX, Assembler::RAX);
+            a.mem(0x2b, Assembler::RDX, JIT_STATE, offsetof(State, heap_raddr));
+            a.mem(0x3b, Assembler::RDX, JIT_STATE, offsetof(State, heap_size));
+            a.rel32(0x0f83, invalid_address);
+            a.patch(in_memory, a.i);
+          }
+#endif
+#if WF_VERIFY
+          if(op == OP_STORE) {
+            // Only stores below verify_end can hit verified code
+            a.mem(0x3b, Assembler::RAX, JIT_STATE, offsetof(State, verify_end));
+            size_t past = a.rel32(0x0f83, 0);
+            a.reg(0x89, Assembler::RSI, Assembler::RAX);
+            jit_call(a, (const void*) &jit_verify_store, false, 0, error_exit);
+            a.mem(0x8b, Assembler::RAX, JIT_SP, -8);
+            a.patch(past, a.i);
+          }
+#endif
+          a.mem(0x8b, Assembler::RCX, JIT_STATE, offsetof(State, memory));
+          a.mem(0x3b, Assembler::RAX, JIT_STATE, offsetof(State, base_i));
+          if(op == OP_FETCH) {
+            // cmovb rcx, base_memory: addresses below base_i are in the base dictionary
+            a.mem(0x0f42, Assembler::RCX, JIT_STATE, offsetof(State, base_memory));
+            a.mem_index(0x8b, Assembler::RAX, Assembler::RCX, Assembler::RAX, 0, 0);
+            a.mem(0x89, Assembler::RAX, JIT_SP, -8);
+          } else {
+#if !WF_UNSAFE
+            // The base dictionary is read only
+            a.rel32(0x0f82, invalid_address);
+#endif
+            a.mem(0x8b, Assembler::RDX, JIT_SP, -16);
+            a.mem_index(0x89, Assembler::RDX, Assembler::RCX, Assembler::RAX, 0, 0);
+            jit_move_sp(a, -2);
+            known -= 2;
+          }
+          break;
+        default:
+          return false;
+      }
+
+      c = next;
+    }
+
+    for(size_t f = 0; f != fixups_i; f += 2) {
+      if(offsets[fixups[f + 1]] == NONE || offsets[fixups[f + 1]] == TARGET) {
+        return false;
+      }
+      a.patch(fixups[f], offsets[fixups[f + 1]]);
+    }
+
+    if(a.overflow) {
+      return false;
+    }
+
+    JitWord& w = jit_words()[jit_words_i];
+    w.code = start_i;
+    w.saved[0] = code[0];
+    w.saved[1] = code[1];
+    w.native = &jit_memory[jit_i + entry];
+    w.start = jit_i;
+
+    WF_LOG(WF_CC, "jit word @ " << start_i << " " << a.i << " bytes");
+
+    jit_words_i++;
+    jit_i = align(16, jit_i + a.i);
+    return true;
+  }
+#endif
 };
 
 }; // namespace ft